@@ -0,0 +1,1315 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Verdict cache used by avCommon.c, see avCache.h.
+ * Include this file in your plugin's project.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "avApi.h"
+#include "avCommon.h"
+#include "avCache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+typedef CRITICAL_SECTION cacheLock;
+typedef CONDITION_VARIABLE cacheCondition;
+#define CACHE_LOCK_INIT(l) InitializeCriticalSection(l)
+#define CACHE_LOCK_DESTROY(l) DeleteCriticalSection(l)
+#define CACHE_LOCK(l) EnterCriticalSection(l)
+#define CACHE_UNLOCK(l) LeaveCriticalSection(l)
+#define CACHE_CONDITION_INIT(c) InitializeConditionVariable(c)
+#define CACHE_BROADCAST(c) WakeAllConditionVariable(c)
+#define CACHE_THREAD __declspec(thread)
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+typedef pthread_mutex_t cacheLock;
+typedef pthread_cond_t cacheCondition;
+#define CACHE_LOCK_INIT(l) pthread_mutex_init(l, NULL)
+#define CACHE_LOCK_DESTROY(l) pthread_mutex_destroy(l)
+#define CACHE_LOCK(l) pthread_mutex_lock(l)
+#define CACHE_UNLOCK(l) pthread_mutex_unlock(l)
+#define CACHE_CONDITION_INIT(c) initCondition(c)
+#define CACHE_BROADCAST(c) pthread_cond_broadcast(c)
+#define CACHE_THREAD __thread
+#endif
+
+/**
+ * Count of independently locked shards
+ */
+#define CACHE_SHARDS 16
+
+/**
+ * Expected memory of one entry, used to size hash tables
+ */
+#define CACHE_ENTRY_ESTIMATE 128
+
+/**
+ * Entries are allocated in multiples of this size, so that an evicted entry fits most new verdicts
+ */
+#define CACHE_ENTRY_ALIGN 32
+
+/**
+ * Buffer size for reading files being hashed
+ */
+#define CACHE_READ_BUFFER 65536
+
+/**
+ * Slots of the mapped table searched for one key
+ */
+#define MAPPED_PROBE_LIMIT 8
+
+/**
+ * Seconds after which a verdict in the mapped table is not trusted even with the same engine version
+ */
+#define MAPPED_MAX_AGE (7 * 24 * 3600)
+
+/**
+ * Offset of the first slot, the header occupies one page
+ */
+#define MAPPED_HEADER_SIZE 4096
+
+/**
+ * Identification and format version of the mapped table
+ */
+#define MAPPED_MAGIC "KAVCACHE"
+#define MAPPED_FORMAT 1
+
+/**
+ * Buckets of the table of scans in progress
+ */
+#define FLIGHT_BUCKETS 64
+
+/**
+ * Count of preallocated flights, a scan which finds all of them in use does not share its verdict
+ */
+#define FLIGHT_POOL_SIZE 256
+
+/**
+ * Default seconds a scan waits for concurrent scan of the same content, counted from start of the leader's scan
+ * until the leader notes its own deadline
+ */
+#define DEFAULT_FLIGHT_TIMEOUT 300
+
+/**
+ * Seconds since the last change of a file before its identity key is trusted. A file changed again within
+ * timestamp granularity, or a new file reusing the inode, could otherwise get the identity of an old verdict.
+ */
+#define IDENTITY_SETTLE_TIME 2
+
+/**
+ * Kinds of keys
+ */
+#define KEY_IDENTITY 1
+#define KEY_CONTENT 2
+
+/**
+ * Cached verdict, virus name is allocated together with the entry. Size is the allocated size, 
+ * a recycled entry may be larger than its verdict needs.
+ */
+typedef struct _avCacheEntry {
+    unsigned char key[AVCACHE_KEY_SIZE];
+    unsigned char kind;
+    unsigned int hash;
+    unsigned int generation;
+    int result;
+    unsigned long size;
+    struct _avCacheEntry *chain;
+    struct _avCacheEntry *newer;
+    struct _avCacheEntry *older;
+    char info[1];
+} avCacheEntry;
+
+/**
+ * Hash table with LRU list, limited by memory
+ */
+typedef struct _avCacheShard {
+    cacheLock lock;
+    avCacheEntry **buckets;
+    unsigned int bucketCount;
+    avCacheEntry *newest;
+    avCacheEntry *oldest;
+    unsigned long used;
+    unsigned long limit;
+} avCacheShard;
+
+static avCacheShard shards[CACHE_SHARDS];
+
+/**
+ * Header of the mapped table file
+ */
+typedef struct _avMappedHeader {
+    char magic[8];
+    unsigned int format;
+    unsigned int slotSize;
+    unsigned int slotCount;
+} avMappedHeader;
+
+/**
+ * Slot of the mapped table shared by all processes using the file, 128 bytes.
+ * The slot is written under sequence lock: sequence is odd while a writer owns it, readers copy the slot
+ * and retry nothing, a changed sequence or a wrong checksum is simply a miss. The checksum also rejects
+ * slots torn by a system crash, as the file is never synced.
+ */
+typedef struct _avMappedSlot {
+    volatile unsigned int sequence;
+    unsigned int checksum;
+    unsigned int version;
+    unsigned int timestamp;
+    unsigned char key[AVCACHE_KEY_SIZE];
+    unsigned char used;
+    unsigned char result;
+    volatile unsigned char referenced;
+    unsigned char reserved[5];
+    char info[64];
+} avMappedSlot;
+
+/**
+ * Mapped table, valid while mappedSlots is not NULL
+ */
+static avMappedSlot *mappedSlots = NULL;
+static unsigned int mappedCount = 0;
+static void *mappedBase = NULL;
+static size_t mappedSize = 0;
+static int mappedFile = -1;
+
+/**
+ * Scan of one content in progress. The leader scans the file, the other scans of the same content wait
+ * for its verdict. If the leader fails, one of the waiters takes over. The flight is returned to the pool 
+ * by the last of the leader and the waiters.
+ */
+typedef struct _avFlight {
+    unsigned char key[AVCACHE_KEY_SIZE];
+    int leader;
+    int done;
+    int result;
+
+    /**
+     * Time from cacheClock() after which waiters stop waiting for the leader and scan alone
+     */
+    unsigned long long deadline;
+    unsigned int references;
+    cacheCondition changed;
+    struct _avFlight *next;
+    char info[MAX_STRING];
+} avFlight;
+
+/**
+ * Scans in progress by content key, guarded by flightLock
+ */
+static avFlight *flights[FLIGHT_BUCKETS];
+static unsigned int flightTimeout = DEFAULT_FLIGHT_TIMEOUT;
+
+/**
+ * Pool of flights, guarded by flightLock. Flights are created on first use and kept with their condition.
+ */
+static avFlight flightPool[FLIGHT_POOL_SIZE];
+static unsigned int flightsCreated = 0;
+static avFlight *freeFlights = NULL;
+
+/**
+ * Flight led by the calling thread, its deadline is set by verdictCacheNoteDeadline()
+ */
+static CACHE_THREAD avFlight *leadingFlight = NULL;
+
+/**
+ * Buffer for reading files being hashed, one per scanning thread
+ */
+static CACHE_THREAD unsigned char readBuffer[CACHE_READ_BUFFER];
+
+/**
+ * Non-zero when the cache is created
+ */
+static volatile int cacheEnabled = 0;
+
+/**
+ * Incremented on every engine version change, entries and keys of older generations are ignored
+ */
+static volatile unsigned int cacheGeneration = 1;
+
+/**
+ * Last engine version reported by the plugin, guarded by versionLock
+ */
+static char engineVersion[MAX_STRING] = "";
+
+/**
+ * Hash of engine version stored with verdicts in the mapped table, 0 when no version is known
+ */
+static volatile unsigned int engineVersionHash = 0;
+#ifdef _WIN32
+static cacheLock versionLock;
+static cacheLock flightLock;
+static volatile LONG versionLockReady = 0;
+#else
+static cacheLock versionLock = PTHREAD_MUTEX_INITIALIZER;
+static cacheLock flightLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+
+typedef struct _sha256Context {
+    unsigned int state[8];
+    unsigned char block[64];
+    unsigned long long length;
+    unsigned int used;
+} sha256Context;
+
+static const unsigned int sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Transform(sha256Context *ctx, const unsigned char *data)
+{
+    unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((unsigned int) data[i * 4] << 24) | ((unsigned int) data[i * 4 + 1] << 16) |
+                ((unsigned int) data[i * 4 + 2] << 8) | (unsigned int) data[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7] +
+                (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256Init(sha256Context *ctx)
+{
+    ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85; ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c; ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256Update(sha256Context *ctx, const unsigned char *data, size_t size)
+{
+    ctx->length += size;
+    while (size > 0) {
+        size_t count = 64 - ctx->used;
+        if (count > size) {
+            count = size;
+        }
+        memcpy(ctx->block + ctx->used, data, count);
+        ctx->used += count;
+        data += count;
+        size -= count;
+        if (ctx->used == 64) {
+            sha256Transform(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256Final(sha256Context *ctx, unsigned char *digest)
+{
+    unsigned long long bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256Transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (i = 0; i < 8; i++) {
+        ctx->block[63 - i] = (unsigned char) (bits >> (i * 8));
+    }
+    sha256Transform(ctx, ctx->block);
+
+    for (i = 0; i < 32; i++) {
+        digest[i] = (unsigned char) (ctx->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+/*
+ * Sharded LRU
+ */
+
+/**
+ * Store 64-bit number into key
+ */
+static void putNumber(unsigned char *key, unsigned long long value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        key[i] = (unsigned char) (value >> (56 - i * 8));
+    }
+}
+
+/**
+ * FNV-1a hash of a key, selects shard and bucket
+ */
+static unsigned int keyHash(const unsigned char *key)
+{
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < AVCACHE_KEY_SIZE; i++) {
+        hash = (hash ^ key[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static avCacheShard *shardOf(unsigned int hash)
+{
+    return &shards[(hash >> 24) % CACHE_SHARDS];
+}
+
+/**
+ * Unlink entry from bucket chain and LRU list, shard must be locked
+ */
+static void unlinkEntry(avCacheShard *shard, avCacheEntry *entry)
+{
+    avCacheEntry **link = &shard->buckets[entry->hash % shard->bucketCount];
+
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    }
+    else {
+        shard->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    }
+    else {
+        shard->oldest = entry->newer;
+    }
+
+    shard->used -= entry->size;
+}
+
+/**
+ * Unlink entry and free it, shard must be locked
+ */
+static void removeEntry(avCacheShard *shard, avCacheEntry *entry)
+{
+    unlinkEntry(shard, entry);
+    free(entry);
+}
+
+/**
+ * Keep an unlinked entry for reuse if it has the size needed and no other is kept already, free it otherwise
+ *
+ * \return entry kept for reuse, NULL if none
+ */
+static avCacheEntry *recycleEntry(avCacheEntry *spare, avCacheEntry *entry, size_t size)
+{
+    if ((spare == NULL) && (entry->size >= size)) {
+        return entry;
+    }
+    free(entry);
+    return spare;
+}
+
+/**
+ * Drop all entries of a shard, shard must be locked
+ */
+static void clearShard(avCacheShard *shard)
+{
+    while (shard->oldest) {
+        removeEntry(shard, shard->oldest);
+    }
+}
+
+/**
+ * Find entry of current generation and mark it recently used
+ *
+ * \return cached result, -1 if not found
+ */
+static int findEntry(unsigned char kind, const unsigned char *key, char *vir_info, unsigned int vi_size)
+{
+    unsigned int hash = keyHash(key);
+    avCacheShard *shard = shardOf(hash);
+    avCacheEntry *entry;
+    int result = -1;
+
+    CACHE_LOCK(&shard->lock);
+    for (entry = shard->buckets[hash % shard->bucketCount]; entry; entry = entry->chain) {
+        if ((entry->hash == hash) && (entry->kind == kind) && (0 == memcmp(entry->key, key, AVCACHE_KEY_SIZE))) {
+            break;
+        }
+    }
+    if (entry && (entry->generation != cacheGeneration)) {
+        removeEntry(shard, entry);
+        entry = NULL;
+    }
+    if (entry) {
+        /* move to the head of LRU list */
+        if (entry->newer) {
+            entry->newer->older = entry->older;
+            if (entry->older) {
+                entry->older->newer = entry->newer;
+            }
+            else {
+                shard->oldest = entry->newer;
+            }
+            entry->older = shard->newest;
+            entry->newer = NULL;
+            shard->newest->newer = entry;
+            shard->newest = entry;
+        }
+        result = entry->result;
+        if (vir_info && vi_size) {
+            strncpy(vir_info, entry->info, vi_size);
+            vir_info[vi_size - 1] = 0; // safe string
+        }
+    }
+    CACHE_UNLOCK(&shard->lock);
+    return result;
+}
+
+/**
+ * Insert or replace entry, the least recently used entries are evicted to fit memory limit. The replaced 
+ * or an evicted entry is reused, so that a full cache does not allocate.
+ */
+static void insertEntry(unsigned char kind, const unsigned char *key, unsigned int generation, int result, const char *info)
+{
+    unsigned int hash = keyHash(key);
+    avCacheShard *shard = shardOf(hash);
+    size_t length = strlen(info);
+    size_t size = (sizeof(avCacheEntry) + length + CACHE_ENTRY_ALIGN - 1) / CACHE_ENTRY_ALIGN * CACHE_ENTRY_ALIGN;
+    avCacheEntry *entry = NULL;
+    avCacheEntry *old;
+
+    if (size > shard->limit) {
+        return;
+    }
+
+    CACHE_LOCK(&shard->lock);
+    if (generation != cacheGeneration) {
+        CACHE_UNLOCK(&shard->lock); // verdict of previous engine version
+        return;
+    }
+    for (old = shard->buckets[hash % shard->bucketCount]; old; old = old->chain) {
+        if ((old->hash == hash) && (old->kind == kind) && (0 == memcmp(old->key, key, AVCACHE_KEY_SIZE))) {
+            unlinkEntry(shard, old);
+            entry = recycleEntry(entry, old, size);
+            break;
+        }
+    }
+    while (shard->oldest && (shard->used + (entry ? entry->size : size) > shard->limit)) {
+        old = shard->oldest;
+        unlinkEntry(shard, old);
+        entry = recycleEntry(entry, old, size);
+    }
+    if (entry == NULL) {
+        entry = (avCacheEntry *) malloc(size);
+        if (entry == NULL) {
+            CACHE_UNLOCK(&shard->lock);
+            return;
+        }
+        entry->size = size;
+    }
+    memcpy(entry->key, key, AVCACHE_KEY_SIZE);
+    entry->kind = kind;
+    entry->hash = hash;
+    entry->generation = generation;
+    entry->result = result;
+    memcpy(entry->info, info, length + 1);
+
+    entry->chain = shard->buckets[hash % shard->bucketCount];
+    shard->buckets[hash % shard->bucketCount] = entry;
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if (shard->newest) {
+        shard->newest->newer = entry;
+    }
+    else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+    shard->used += entry->size;
+    CACHE_UNLOCK(&shard->lock);
+}
+
+/*
+ * Mapped table
+ */
+
+/**
+ * FNV-1a hash of a string, 0 is reserved for unknown version
+ */
+static unsigned int stringHash(const char *value)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*value) {
+        hash = (hash ^ (unsigned char) *value++) * 16777619U;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Checksum of slot content, sequence and clock bit are not covered
+ */
+static unsigned int slotChecksum(const avMappedSlot *slot)
+{
+    const unsigned char *data = (const unsigned char *) &slot->version;
+    const unsigned char *end = (const unsigned char *) &slot->referenced;
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (; data < end; data++) {
+        hash = (hash ^ *data) * 16777619U;
+    }
+    for (i = 0; i < sizeof(slot->info); i++) {
+        hash = (hash ^ (unsigned char) slot->info[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Copy a slot consistently
+ *
+ * \return 1 if the copy is a valid verdict, 0 if the slot is empty, damaged or being written
+ */
+static int readSlot(avMappedSlot *slot, avMappedSlot *copy)
+{
+    unsigned int sequence = slot->sequence;
+
+    if (sequence & 1) {
+        return 0;
+    }
+    __sync_synchronize();
+    memcpy(copy, (const void *) slot, sizeof(*copy));
+    __sync_synchronize();
+    if (slot->sequence != sequence) {
+        return 0;
+    }
+    return copy->used && (copy->checksum == slotChecksum(copy));
+}
+
+/**
+ * Check that a verdict copied from the table may be used now
+ */
+static int isSlotCurrent(const avMappedSlot *copy, unsigned int version, unsigned int now)
+{
+    return (copy->version == version) && (copy->timestamp <= now) && (now - copy->timestamp < MAPPED_MAX_AGE);
+}
+
+/**
+ * Find verdict of content key in the mapped table and set its clock bit
+ *
+ * \return cached result, -1 if not found
+ */
+static int findMapped(const unsigned char *key, char *vir_info, unsigned int vi_size)
+{
+    unsigned int version = engineVersionHash;
+    unsigned int now = (unsigned int) time(NULL);
+    unsigned int start;
+    avMappedSlot copy;
+    int i;
+
+    if ((mappedSlots == NULL) || (version == 0)) {
+        return -1;
+    }
+    start = keyHash(key) % mappedCount;
+    for (i = 0; i < MAPPED_PROBE_LIMIT; i++) {
+        avMappedSlot *slot = &mappedSlots[(start + i) % mappedCount];
+        if (!readSlot(slot, &copy) || (0 != memcmp(copy.key, key, AVCACHE_KEY_SIZE))) {
+            continue;
+        }
+        if (!isSlotCurrent(&copy, version, now)) {
+            return -1;
+        }
+        slot->referenced = 1;
+        if (vir_info && vi_size) {
+            strncpy(vir_info, copy.info, vi_size);
+            vir_info[vi_size - 1] = 0; // safe string
+        }
+        return copy.result;
+    }
+    return -1;
+}
+
+/**
+ * Store verdict of content key into the mapped table. A slot with the same key, an empty or outdated one
+ * is preferred, otherwise the clock hand sweeps the probed slots and evicts the first one not referenced
+ * since the previous sweep. The store is skipped if another writer owns the slot.
+ */
+static void insertMapped(const unsigned char *key, int result, const char *info)
+{
+    unsigned int version = engineVersionHash;
+    unsigned int now = (unsigned int) time(NULL);
+    unsigned int start;
+    unsigned int sequence;
+    avMappedSlot *victim = NULL;
+    avMappedSlot *slot;
+    avMappedSlot copy;
+    int i;
+
+    if ((mappedSlots == NULL) || (version == 0) || (strlen(info) >= sizeof(copy.info))) {
+        return;
+    }
+    start = keyHash(key) % mappedCount;
+    for (i = 0; i < MAPPED_PROBE_LIMIT; i++) {
+        slot = &mappedSlots[(start + i) % mappedCount];
+        if (!readSlot(slot, &copy) || !isSlotCurrent(&copy, version, now) ||
+                (0 == memcmp(copy.key, key, AVCACHE_KEY_SIZE))) {
+            victim = slot;
+            break;
+        }
+    }
+    for (i = 0; (victim == NULL) && (i < MAPPED_PROBE_LIMIT); i++) {
+        slot = &mappedSlots[(start + i) % mappedCount];
+        if (slot->referenced) {
+            slot->referenced = 0;
+        }
+        else {
+            victim = slot;
+        }
+    }
+    if (victim == NULL) {
+        victim = &mappedSlots[start];
+    }
+
+    sequence = victim->sequence;
+    if ((sequence & 1) || !__sync_bool_compare_and_swap(&victim->sequence, sequence, sequence + 1)) {
+        return;
+    }
+    __sync_synchronize();
+    memset(victim->info, 0, sizeof(victim->info));
+    memcpy(victim->key, key, AVCACHE_KEY_SIZE);
+    strcpy(victim->info, info);
+    victim->version = version;
+    victim->timestamp = now;
+    victim->result = (unsigned char) result;
+    victim->used = 1;
+    memset(victim->reserved, 0, sizeof(victim->reserved));
+    victim->referenced = 0;
+    victim->checksum = slotChecksum(victim);
+    __sync_synchronize();
+    victim->sequence = sequence + 2;
+}
+
+#ifndef _WIN32
+/**
+ * Create or repair the table, the file must be locked exclusively
+ *
+ * \param alone non-zero if no other process has the file open
+ */
+static int prepareMappedFile(int fd, const char *path, unsigned int slotCount, int alone)
+{
+    avMappedHeader header;
+    struct stat sb;
+
+    if (0 != fstat(fd, &sb)) {
+        return 0;
+    }
+    if ((sb.st_size >= MAPPED_HEADER_SIZE) && (pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+            (0 == memcmp(header.magic, MAPPED_MAGIC, sizeof(header.magic))) && (header.format == MAPPED_FORMAT) &&
+            (header.slotSize == sizeof(avMappedSlot)) && (header.slotCount > 0) &&
+            (sb.st_size == (off_t) MAPPED_HEADER_SIZE + (off_t) header.slotCount * sizeof(avMappedSlot)) &&
+            (alone ? (header.slotCount == slotCount) : 1)) {
+        return 1;
+    }
+    if (!alone) {
+        logError("Verdict cache file %s is damaged and it is used by another process", path);
+        return 0;
+    }
+
+    /* new, damaged or resized table is created empty */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(header.magic));
+    header.format = MAPPED_FORMAT;
+    header.slotSize = sizeof(avMappedSlot);
+    header.slotCount = slotCount;
+    if ((0 != ftruncate(fd, 0)) || (0 != ftruncate(fd, (off_t) MAPPED_HEADER_SIZE + (off_t) slotCount * sizeof(avMappedSlot))) ||
+            (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))) {
+        logError("Cannot create verdict cache file %s", path);
+        return 0;
+    }
+    logDebug("Verdict cache file %s has been created", path);
+    return 1;
+}
+#endif
+
+/*
+ * Scans in progress
+ */
+
+/**
+ * Monotonic clock for flight deadlines
+ *
+ * \return milliseconds
+ */
+static unsigned long long cacheClock(void)
+{
+#ifdef _WIN32
+    return (unsigned long long) GetTickCount64();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+#ifndef _WIN32
+/**
+ * Create condition of a flight, its timed waits use the monotonic clock, so that they are not 
+ * shortened or stretched by changes of wall clock
+ */
+static void initCondition(cacheCondition *condition)
+{
+    pthread_condattr_t attributes;
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(condition, &attributes);
+    pthread_condattr_destroy(&attributes);
+}
+#endif
+
+static avFlight **flightBucket(const unsigned char *key)
+{
+    return &flights[keyHash(key) % FLIGHT_BUCKETS];
+}
+
+/**
+ * Wait for the flight to change until its deadline, flightLock must be locked
+ *
+ * \return 0 on timeout
+ */
+static int waitFlight(avFlight *flight)
+{
+    unsigned long long now = cacheClock();
+#ifndef _WIN32
+    struct timespec deadline;
+#endif
+
+    if (now >= flight->deadline) {
+        return 0;
+    }
+#ifdef _WIN32
+    return SleepConditionVariableCS(&flight->changed, &flightLock, (DWORD) (flight->deadline - now)) || 
+            (GetLastError() != ERROR_TIMEOUT);
+#else
+    deadline.tv_sec = (time_t) (flight->deadline / 1000);
+    deadline.tv_nsec = (long) (flight->deadline % 1000) * 1000000;
+    return (ETIMEDOUT != pthread_cond_timedwait(&flight->changed, &flightLock, &deadline));
+#endif
+}
+
+/**
+ * Unlink flight from the table, flightLock must be locked
+ */
+static void unlinkFlight(avFlight *flight)
+{
+    avFlight **link = flightBucket(flight->key);
+
+    while (*link && (*link != flight)) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = flight->next;
+    }
+    flight->next = NULL;
+}
+
+/**
+ * Take a flight from the pool, flightLock must be locked
+ *
+ * \return NULL when all flights are in use
+ */
+static avFlight *takeFlight(void)
+{
+    avFlight *flight = freeFlights;
+
+    if (flight) {
+        freeFlights = flight->next;
+    }
+    else if (flightsCreated < FLIGHT_POOL_SIZE) {
+        flight = &flightPool[flightsCreated++];
+        CACHE_CONDITION_INIT(&flight->changed);
+    }
+    return flight;
+}
+
+/**
+ * Drop one reference of flight, the last one returns it to the pool, flightLock must be locked
+ */
+static void releaseFlight(avFlight *flight)
+{
+    if (--flight->references == 0) {
+        flight->next = freeFlights;
+        freeFlights = flight;
+    }
+}
+
+/**
+ * Leader has finished the scan. Verdict is handed to all waiters, failure lets one of them take over.
+ */
+static void finishFlight(const unsigned char *key, int result, const char *info)
+{
+    avFlight *flight;
+
+    CACHE_LOCK(&flightLock);
+    for (flight = *flightBucket(key); flight; flight = flight->next) {
+        if (flight->leader && (0 == memcmp(flight->key, key, AVCACHE_KEY_SIZE))) {
+            break;
+        }
+    }
+    leadingFlight = NULL;
+    if (flight) {
+        flight->leader = 0;
+        if ((result == AVCHK_OK) || (result == AVCHK_VIRUS_FOUND)) {
+            flight->done = 1;
+            flight->result = result;
+            strncpy(flight->info, info, sizeof(flight->info));
+            flight->info[sizeof(flight->info) - 1] = 0; // safe string
+        }
+        if (flight->done || (flight->references == 1)) {
+            unlinkFlight(flight);
+        }
+        CACHE_BROADCAST(&flight->changed);
+        releaseFlight(flight);
+    }
+    CACHE_UNLOCK(&flightLock);
+}
+
+/*
+ * Keys
+ */
+
+/**
+ * Compute identity key from file metadata. Nanosecond timestamps are needed to notice
+ * rewrites within one second, so the pre-check is used on Linux only. Files changed less than
+ * IDENTITY_SETTLE_TIME ago have no identity, their content is hashed.
+ *
+ * \return 1 on success, 0 if identity cannot be trusted
+ */
+static int identityKey(const struct stat *sb, unsigned char *key)
+{
+#ifdef __linux__
+    if (!S_ISREG(sb->st_mode) || (sb->st_ctim.tv_sec + IDENTITY_SETTLE_TIME > time(NULL))) {
+        return 0;
+    }
+    putNumber(key, (unsigned long long) sb->st_dev);
+    putNumber(key + 8, (unsigned long long) sb->st_ino);
+    putNumber(key + 16, (unsigned long long) sb->st_size);
+    putNumber(key + 24, (unsigned long long) sb->st_mtim.tv_sec * 1000000000ULL + sb->st_mtim.tv_nsec);
+    putNumber(key + 32, (unsigned long long) sb->st_ctim.tv_sec * 1000000000ULL + sb->st_ctim.tv_nsec);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Read from the given position of a file, the file position is not used on POSIX systems
+ *
+ * \return count of bytes read, 0 at the end of the file, -1 on error
+ */
+static long readAt(int fd, unsigned char *buffer, unsigned int size, unsigned long long offset)
+{
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64) offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return (long) _read(fd, buffer, size);
+#else
+    ssize_t count;
+
+    do {
+        count = pread(fd, buffer, size, (off_t) offset);
+    } while ((count < 0) && (errno == EINTR));
+    return (long) count;
+#endif
+}
+
+/**
+ * Compute content key, SHA-256 of the file followed by its size
+ *
+ * \return 1 on success, 0 if the file cannot be read
+ */
+static int contentKey(int fd, unsigned char *key)
+{
+    sha256Context ctx;
+    long count;
+
+    sha256Init(&ctx);
+    while ((count = readAt(fd, readBuffer, CACHE_READ_BUFFER, ctx.length)) > 0) {
+        sha256Update(&ctx, readBuffer, (size_t) count);
+    }
+    putNumber(key + 32, ctx.length);
+    sha256Final(&ctx, key);
+    return (count == 0);
+}
+
+/*
+ * Public functions
+ */
+
+/**
+ * Create static locks on Windows, they are initialized statically elsewhere
+ */
+static void prepareLocks(void)
+{
+#ifdef _WIN32
+    if (0 == InterlockedCompareExchange(&versionLockReady, 1, 0)) {
+        CACHE_LOCK_INIT(&versionLock);
+        CACHE_LOCK_INIT(&flightLock);
+        versionLockReady = 2;
+    }
+    while (versionLockReady != 2) {
+        Sleep(0);
+    }
+#endif
+}
+
+static void lockVersion(void)
+{
+    prepareLocks();
+    CACHE_LOCK(&versionLock);
+}
+
+int verdictCacheInit(unsigned long maxMemory)
+{
+    unsigned int buckets = 16;
+    int i;
+
+    verdictCacheClose();
+    if (maxMemory == 0) {
+        return 1;
+    }
+
+    /* power of two buckets, about one per expected entry */
+    while ((buckets < (1U << 20)) && ((unsigned long) buckets * CACHE_ENTRY_ESTIMATE < maxMemory / CACHE_SHARDS)) {
+        buckets <<= 1;
+    }
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        shards[i].buckets = (avCacheEntry **) calloc(buckets, sizeof(avCacheEntry *));
+        if (shards[i].buckets == NULL) {
+            while (--i >= 0) {
+                free(shards[i].buckets);
+                CACHE_LOCK_DESTROY(&shards[i].lock);
+                shards[i].buckets = NULL;
+            }
+            logError("Cannot allocate verdict cache");
+            return 0;
+        }
+        shards[i].bucketCount = buckets;
+        shards[i].limit = maxMemory / CACHE_SHARDS;
+        CACHE_LOCK_INIT(&shards[i].lock);
+    }
+    cacheEnabled = 1;
+    logDebug("Verdict cache of %lu kB is enabled", maxMemory / 1024);
+    return 1;
+}
+
+int verdictCacheOpenFile(const char *path, unsigned long size)
+{
+#ifdef _WIN32
+    logWarning("Verdict cache file is not supported on this platform");
+    return 0;
+#else
+    unsigned int slotCount;
+    avMappedHeader *header;
+    struct stat sb;
+    void *base;
+    int alone;
+    int fd;
+    unsigned int i;
+
+    verdictCacheCloseFile();
+    if ((path == NULL) || (path[0] == 0) || (size <= MAPPED_HEADER_SIZE)) {
+        return 1;
+    }
+    slotCount = (unsigned int) ((size - MAPPED_HEADER_SIZE) / sizeof(avMappedSlot));
+
+    /* verdicts from the file are trusted, nobody else may write it */
+    fd = openPrivateFile(path, "verdict cache file");
+    if (fd < 0) {
+        return 0;
+    }
+
+    /* the process which has the file alone may create, resize or repair it */
+    alone = (0 == flock(fd, LOCK_EX | LOCK_NB));
+    if (!alone && (0 != flock(fd, LOCK_EX))) {
+        close(fd);
+        return 0;
+    }
+    if (!prepareMappedFile(fd, path, slotCount, alone) || (0 != fstat(fd, &sb))) {
+        close(fd);
+        return 0;
+    }
+    base = mmap(NULL, (size_t) sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        logError("Cannot map verdict cache file %s", path);
+        close(fd);
+        return 0;
+    }
+    header = (avMappedHeader *) base;
+    mappedSlots = (avMappedSlot *) ((char *) base + MAPPED_HEADER_SIZE);
+    if (alone) {
+        /* slots left locked by a crashed writer are released and emptied */
+        for (i = 0; i < header->slotCount; i++) {
+            if (mappedSlots[i].sequence & 1) {
+                mappedSlots[i].used = 0;
+                mappedSlots[i].sequence++;
+            }
+        }
+    }
+
+    /* shared lock is held while the file is mapped, so that nobody recreates it under our hands */
+    flock(fd, LOCK_SH);
+    mappedBase = base;
+    mappedSize = (size_t) sb.st_size;
+    mappedFile = fd;
+    mappedCount = header->slotCount;
+    logDebug("Verdict cache file %s with %u entries is open", path, mappedCount);
+    return 1;
+#endif
+}
+
+void verdictCacheCloseFile(void)
+{
+#ifndef _WIN32
+    if (mappedBase == NULL) {
+        return;
+    }
+    mappedSlots = NULL;
+    mappedCount = 0;
+    munmap(mappedBase, mappedSize);
+    close(mappedFile);
+    mappedBase = NULL;
+    mappedSize = 0;
+    mappedFile = -1;
+#endif
+}
+
+void verdictCacheClose(void)
+{
+    int i;
+
+    verdictCacheCloseFile();
+    if (!cacheEnabled) {
+        return;
+    }
+    cacheEnabled = 0;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        CACHE_LOCK(&shards[i].lock);
+        clearShard(&shards[i]);
+        CACHE_UNLOCK(&shards[i].lock);
+        CACHE_LOCK_DESTROY(&shards[i].lock);
+        free(shards[i].buckets);
+        shards[i].buckets = NULL;
+    }
+}
+
+void verdictCacheSetEngineVersion(const char *version)
+{
+    int changed;
+    int i;
+
+    if (version == NULL) {
+        return;
+    }
+
+    lockVersion();
+    changed = (0 != strcmp(engineVersion, version));
+    if (changed && engineVersion[0] && cacheEnabled) {
+        logDebug("Engine version has changed to %s, verdict cache is flushed", version);
+    }
+    if (changed) {
+        strncpy(engineVersion, version, sizeof(engineVersion));
+        engineVersion[sizeof(engineVersion) - 1] = 0; // safe string
+        engineVersionHash = engineVersion[0] ? stringHash(engineVersion) : 0;
+        cacheGeneration++;
+    }
+    CACHE_UNLOCK(&versionLock);
+
+    if (changed && cacheEnabled) {
+        for (i = 0; i < CACHE_SHARDS; i++) {
+            CACHE_LOCK(&shards[i].lock);
+            clearShard(&shards[i]);
+            CACHE_UNLOCK(&shards[i].lock);
+        }
+    }
+}
+
+int verdictCacheLookup(int fd, const struct stat *sb, avCacheKey *key, char *vir_info, unsigned int vi_size)
+{
+    int result;
+
+    memset(key, 0, sizeof(*key));
+    if ((!cacheEnabled && (mappedSlots == NULL)) || (fd == -1)) {
+        return -1;
+    }
+    key->generation = cacheGeneration;
+
+    /* unchanged file is not read at all */
+    key->hasIdentity = cacheEnabled && identityKey(sb, key->identity);
+    if (key->hasIdentity) {
+        result = findEntry(KEY_IDENTITY, key->identity, vir_info, vi_size);
+        if (result >= 0) {
+            return result;
+        }
+    }
+
+    key->hasContent = contentKey(fd, key->content);
+    if (key->hasContent) {
+        result = cacheEnabled ? findEntry(KEY_CONTENT, key->content, vir_info, vi_size) : -1;
+        if ((result < 0) && ((result = findMapped(key->content, vir_info, vi_size)) >= 0) && cacheEnabled) {
+            insertEntry(KEY_CONTENT, key->content, key->generation, result, vir_info ? vir_info : "");
+        }
+        if (result >= 0) {
+            if (key->hasIdentity) {
+                insertEntry(KEY_IDENTITY, key->identity, key->generation, result, vir_info ? vir_info : "");
+            }
+            return result;
+        }
+    }
+    return -1;
+}
+
+int verdictCacheJoin(avCacheKey *key, char *vir_info, unsigned int vi_size)
+{
+    avFlight **bucket;
+    avFlight *flight;
+    int result = -1;
+
+    if (!key->hasContent) {
+        return -1;
+    }
+    prepareLocks();
+
+    CACHE_LOCK(&flightLock);
+    bucket = flightBucket(key->content);
+    for (flight = *bucket; flight; flight = flight->next) {
+        if (0 == memcmp(flight->key, key->content, AVCACHE_KEY_SIZE)) {
+            break;
+        }
+    }
+    if (flight == NULL) {
+        flight = takeFlight();
+        if (flight == NULL) {
+            CACHE_UNLOCK(&flightLock);
+            return -1;
+        }
+        memcpy(flight->key, key->content, AVCACHE_KEY_SIZE);
+        flight->done = 0;
+        flight->result = 0;
+        flight->info[0] = 0;
+        flight->leader = 1;
+        flight->references = 1;
+        flight->deadline = cacheClock() + (unsigned long long) flightTimeout * 1000;
+        flight->next = *bucket;
+        *bucket = flight;
+        key->isLeader = 1;
+        leadingFlight = flight;
+        CACHE_UNLOCK(&flightLock);
+        return -1;
+    }
+
+    /* the scan waits for the leader until the leader's deadline, then it scans alone as the leader is stuck */
+    flight->references++;
+    while (!flight->done && flight->leader) {
+        if (!waitFlight(flight)) {
+            break;
+        }
+    }
+    if (flight->done) {
+        result = flight->result;
+        if (vir_info && vi_size) {
+            strncpy(vir_info, flight->info, vi_size);
+            vir_info[vi_size - 1] = 0; // safe string
+        }
+    }
+    else if (!flight->leader) {
+        /* the leader has failed, this scan takes over */
+        flight->leader = 1;
+        flight->deadline = cacheClock() + (unsigned long long) flightTimeout * 1000;
+        key->isLeader = 1;
+        leadingFlight = flight;
+        CACHE_UNLOCK(&flightLock);
+        return -1;
+    }
+    releaseFlight(flight);
+    CACHE_UNLOCK(&flightLock);
+    return result;
+}
+
+void verdictCacheSetWaitTimeout(unsigned int seconds)
+{
+    flightTimeout = seconds ? seconds : DEFAULT_FLIGHT_TIMEOUT;
+}
+
+void verdictCacheNoteDeadline(unsigned int milliseconds)
+{
+    if (leadingFlight == NULL) {
+        return;
+    }
+    CACHE_LOCK(&flightLock);
+    leadingFlight->deadline = cacheClock() + milliseconds;
+    CACHE_BROADCAST(&leadingFlight->changed);
+    CACHE_UNLOCK(&flightLock);
+}
+
+void verdictCacheStore(const avCacheKey *key, int result, const char *vir_info)
+{
+    if (vir_info == NULL) {
+        vir_info = "";
+    }
+    if (key->isLeader) {
+        finishFlight(key->content, result, vir_info);
+    }
+    if ((result != AVCHK_OK) && (result != AVCHK_VIRUS_FOUND)) {
+        return;
+    }
+    if (key->hasContent && (key->generation == cacheGeneration)) {
+        insertMapped(key->content, result, vir_info);
+    }
+    if (!cacheEnabled) {
+        return;
+    }
+    if (key->hasContent) {
+        insertEntry(KEY_CONTENT, key->content, key->generation, result, vir_info);
+    }
+    if (key->hasIdentity) {
+        insertEntry(KEY_IDENTITY, key->identity, key->generation, result, vir_info);
+    }
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Verdict cache used by avCommon.c in front of testFile() of the plugin.
+ *
+ * Clean and infected verdicts are remembered by SHA-256 of file content and file size, files which have
+ * not changed since their last scan (same device, inode, modification time and size) are not even read.
+ * The cache is a sharded LRU limited by memory, it is enabled by "VerdictCacheSize" option (megabytes)
+ * in plugin_config and flushed whenever the plugin reports new engine (signature) version.
+ *
+ * Content verdicts may be also kept in a memory-mapped file opened by the plugin, so that they survive restarts
+ * of avserver and are shared by all processes on the host. The file is a fixed-size hash table with clock
+ * eviction, slots are written under per-slot sequence locks and are never synced; verdicts of other engine
+ * versions, older than a week or damaged by a crash are ignored.
+ *
+ * Concurrent scans of the same content (one message to many recipients) are coalesced: the first one scans
+ * the file and the others wait for its verdict, if it fails one of them takes over.
+ */
+
+#ifndef KERIO_AVCACHE_H
+#define KERIO_AVCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct stat;
+
+/**
+ * Size of cache keys in bytes
+ */
+#define AVCACHE_KEY_SIZE 40
+
+/**
+ * Keys of one file computed by verdictCacheLookup() and used by verdictCacheStore()
+ */
+typedef struct _avCacheKey {
+    /**
+     * Device, inode, modification time and size, valid if hasIdentity is non-zero
+     */
+    unsigned char identity[AVCACHE_KEY_SIZE];
+    int hasIdentity;
+
+    /**
+     * SHA-256 of content and size, valid if hasContent is non-zero
+     */
+    unsigned char content[AVCACHE_KEY_SIZE];
+    int hasContent;
+
+    /**
+     * Cache generation when the keys were computed, verdicts of older generations are not stored
+     */
+    unsigned int generation;
+
+    /**
+     * Non-zero if this scan leads scans of the same content, see verdictCacheJoin()
+     */
+    int isLeader;
+} avCacheKey;
+
+/**
+ * Create the cache
+ *
+ * \param maxMemory memory limit in bytes, 0 disables the cache
+ * \return 1 on success, 0 on failure
+ */
+int verdictCacheInit(unsigned long maxMemory);
+
+/**
+ * Drop all entries and disable the cache, the mapped file is closed too
+ */
+void verdictCacheClose(void);
+
+/**
+ * Open (or create) the mapped verdict file, it is used even if the memory cache is disabled.
+ * Existing file of different size is recreated only if no other process uses it.
+ *
+ * \param path file name, empty string disables the file
+ * \param size size of the file in bytes
+ * \return 1 on success or if disabled, 0 on failure
+ */
+int verdictCacheOpenFile(const char *path, unsigned long size);
+
+/**
+ * Unmap and close the mapped verdict file
+ */
+void verdictCacheCloseFile(void);
+
+/**
+ * Report version of engine and signatures, all verdicts are dropped when it changes.
+ * Verdicts in the mapped file are used only while the version matches the one they were stored with.
+ * It may be called by the plugin any time, also before the cache is created.
+ *
+ * \param version engine version, e.g. reply of ClamAV VERSION command
+ */
+void verdictCacheSetEngineVersion(const char *version);
+
+/**
+ * Look verdict of a file up
+ *
+ * \param fd descriptor of the file to check opened by the caller, it is read by position; -1 skips the cache
+ * \param sb status of the open file
+ * \param key keys of the file for verdictCacheStore()
+ * \param vir_info virus name or message of cached verdict
+ * \param vi_size size of vir_info
+ * \return cached AVCHK_OK or AVCHK_VIRUS_FOUND, -1 if the verdict is not cached
+ */
+int verdictCacheLookup(int fd, const struct stat *sb, avCacheKey *key, char *vir_info, unsigned int vi_size);
+
+/**
+ * Wait for verdict of concurrent scan of the same content, called after verdictCacheLookup() has missed.
+ * If no such scan is running, or if it fails, the caller becomes the leader and must scan the file and call
+ * verdictCacheStore() with any result. A caller which has waited past the deadline of the concurrent scan
+ * (see verdictCacheNoteDeadline() and verdictCacheSetWaitTimeout()) scans the file alone.
+ *
+ * \param key keys computed by verdictCacheLookup()
+ * \param vir_info virus name or message of the shared verdict
+ * \param vi_size size of vir_info
+ * \return AVCHK_OK or AVCHK_VIRUS_FOUND of concurrent scan, -1 if the caller must scan the file
+ */
+int verdictCacheJoin(avCacheKey *key, char *vir_info, unsigned int vi_size);
+
+/**
+ * Set how long scans wait for concurrent scan of the same content, counted from the start of that scan.
+ * The plugin should set it to the longest time its own scan may take, or to the time until it calls 
+ * verdictCacheNoteDeadline().
+ *
+ * \param seconds wait timeout, 0 restores the default
+ */
+void verdictCacheSetWaitTimeout(unsigned int seconds);
+
+/**
+ * Note deadline of the scan running in the calling thread, may be called from testFile() once the plugin
+ * knows it, e.g. from the size of the file. Scans waiting for this one in verdictCacheJoin() wait until 
+ * the deadline instead of the wait timeout, then they scan the file alone.
+ *
+ * \param milliseconds time from now
+ */
+void verdictCacheNoteDeadline(unsigned int milliseconds);
+
+/**
+ * Remember verdict of a file, only AVCHK_OK and AVCHK_VIRUS_FOUND are stored.
+ * Scans waiting in verdictCacheJoin() get the verdict, or one of them takes over on failure.
+ *
+ * \param key keys computed by verdictCacheLookup()
+ * \param result check result code
+ * \param vir_info virus name or message
+ */
+void verdictCacheStore(const avCacheKey *key, int result, const char *vir_info);
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif // KERIO_AVCACHE_H
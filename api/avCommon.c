@@ -14,9 +14,52 @@
 #include <string.h>
 #include "avApi.h"
 #include "avCommon.h"
+#include "avCache.h"
+#include "avJournal.h"
+#include "avLog.h"
 #include "avName.h"    // use constants defined in the plugin
 #include "avPlugin.h"  // use functions defined in the plugin -- return pointers to them as plugins' API
 
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define WRAPPER_INCREMENT(c) InterlockedIncrement(c)
+#define WRAPPER_DECREMENT(c) InterlockedDecrement(c)
+#define WRAPPER_SLEEP() Sleep(1)
+#define WRAPPER_THREAD __declspec(thread)
+#define RELAXED_LOAD(p) (*(volatile int *) (p))
+#define RELAXED_STORE(p, v) (*(volatile int *) (p) = (v))
+#else
+#include <errno.h>
+#include <unistd.h>
+#define WRAPPER_INCREMENT(c) __sync_add_and_fetch(c, 1)
+#define WRAPPER_DECREMENT(c) __sync_sub_and_fetch(c, 1)
+#define WRAPPER_SLEEP() usleep(1000)
+#define WRAPPER_THREAD __thread
+#define RELAXED_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define RELAXED_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+
 /**
  * Global error message
  */
@@ -27,47 +70,182 @@ char errorMessage[MAX_STRING] = "";
  */
 AV_LOG_CALLBACK_NEW logCallback = NULL;
 
+/**
+ * Current log level, messages above it are not formatted at all. Read and written by RELAXED_LOAD and
+ * RELAXED_STORE, a new level may reach other threads a little later.
+ */
+static int logLevel = LOG_LEVEL_DEBUG;
+
+/**
+ * Scans inside verdict cache or scan journal, pluginCloseWrapper() waits for them before it closes both.
+ * No scan enters while wrapperClosing is set, such scans go straight to the plugin.
+ */
+static volatile long wrapperScans = 0;
+static volatile long wrapperClosing = 0;
+
+/**
+ * File checked in the calling thread, opened once by testFileWrapper() for verdict cache, the plugin
+ * and scan journal, see getScannedFile()
+ */
+typedef struct _avScannedFile {
+    int fd;
+    unsigned long long size;
+} avScannedFile;
+
+static WRAPPER_THREAD avScannedFile scannedFile = {-1, 0};
+
+/**
+ * Level of "LogLevel" option and file of "LogLevelFile" option which overrides it
+ */
+static int configuredLogLevel = LOG_LEVEL_DEBUG;
+static char logLevelFile[MAX_STRING] = "";
+
+/**
+ * Queue a message for the log thread, or format it and pass it to the log callback
+ * 
+ * \param prefix (const char *) format passed to the log callback with the message
+ * \param format (const char *) null-terminated string format
+ * \param arg (va_list) arguments of format
+ * \return (void)
+ */
+static void logMessage(const char *prefix, const char *format, va_list arg)
+{
+    char buffer[MAX_STRING];
+
+    if (logQueuePush(prefix, format, arg)) {
+        return;
+    }
+    vsnprintf(buffer, sizeof(buffer), format, arg);
+    buffer[MAX_STRING - 1] = 0; // safe string
+    logCallback(prefix, buffer);
+}
+
+/**
+ * Log a message with arguments
+ * 
+ * \param prefix (const char *) format passed to the log callback with the message
+ * \param format (const char *) null-terminated string format
+ * \param  (...) arguments of format
+ * \return (void)
+ */
+static void logLine(const char *prefix, const char *format, ...)
+{
+    va_list arg;
+
+    va_start(arg, format);
+    logMessage(prefix, format, arg);
+    va_end(arg);
+}
+
+/**
+ * Rate of calls of logError() and logWarning() through the functions instead of the macros
+ */
+static avLogRate functionRate[2];
+
+/**
+ * Apply rate limit of the call site, messages suppressed meanwhile are reported once the next one passes
+ * 
+ * \param prefix (const char *) format passed to the log callback with the message
+ * \param rate (avLogRate *) rate of the call site
+ * \return (int) 1 if the message may be logged
+ */
+static int logAllowed(const char *prefix, avLogRate *rate)
+{
+    unsigned int suppressed;
+
+    if (!logRateAllow(rate, &suppressed)) {
+        return 0;
+    }
+    if (suppressed) {
+        logLine(prefix, "%u similar messages have been suppressed", suppressed);
+    }
+    return 1;
+}
+
+/**
+ * Names of log levels
+ */
+static const char *logLevelNames[] = {"Error", "Warning", "Debug"};
+
+/**
+ * Parse log level name or number
+ * 
+ * \param value (const char *) "Error", "Warning", "Debug" or 0-2
+ * \param fallback (int) level returned for unknown value
+ * \return (int) log level
+ */
+static int parseLogLevel(const char *value, int fallback)
+{
+    int level;
+
+    for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++) {
+        if (stricmp(value, logLevelNames[level]) == 0) {
+            return level;
+        }
+    }
+    if ((value[0] >= '0') && (value[0] <= '2') && (value[1] == 0)) {
+        return value[0] - '0';
+    }
+    return fallback;
+}
+
 /**
  * Log a warning message to a Kerio product
  * 
+ * \param rate (avLogRate *) rate of the call site
  * \param format (const char *) null-terminated string format
  * \param  (...) null-terminated strings according to format
  * \return (void)
  */
-void logWarning(const char* format, ...) 
+void logWarningAt(avLogRate *rate, const char* format, ...) 
 {
     va_list arg;
-    char buffer[MAX_STRING];
 
-    if (logCallback && format) {
+    if (logCallback && format && (RELAXED_LOAD(&logLevel) >= LOG_LEVEL_WARNING) && logAllowed("WRN: %s", rate)) {
+        va_start(arg, format);
+        logMessage("WRN: %s", format, arg);
+        va_end(arg);
+    }
+}
+
+void (logWarning)(const char* format, ...) 
+{
+    va_list arg;
+
+    if (logCallback && format && (RELAXED_LOAD(&logLevel) >= LOG_LEVEL_WARNING) && logAllowed("WRN: %s", &functionRate[1])) {
         va_start(arg, format);
-        vsnprintf(buffer, sizeof(buffer), format, arg);
+        logMessage("WRN: %s", format, arg);
         va_end(arg);
-        
-        buffer[MAX_STRING - 1] = 0;
-        logCallback("WRN: %s", buffer);
     }
 }
 
 /**
  * Log an error message to a Kerio product
  * 
+ * \param rate (avLogRate *) rate of the call site
  * \param format (const char *) null-terminated string format 
  * \param  (...) null-terminated strings according to format
  * \return (void)
  */
-void logError(const char* format, ...) 
+void logErrorAt(avLogRate *rate, const char* format, ...) 
 {
     va_list arg;
-    char buffer[MAX_STRING];
 
-    if (logCallback && format) {
+    if (logCallback && format && logAllowed("ERR: %s", rate)) {
         va_start(arg, format);
-        vsnprintf(buffer, sizeof(buffer), format, arg);
+        logMessage("ERR: %s", format, arg);
         va_end(arg);
+    }
+}
+
+void (logError)(const char* format, ...) 
+{
+    va_list arg;
 
-        buffer[MAX_STRING - 1] = 0;
-        logCallback("ERR: %s", buffer);        
+    if (logCallback && format && logAllowed("ERR: %s", &functionRate[0])) {
+        va_start(arg, format);
+        logMessage("ERR: %s", format, arg);
+        va_end(arg);
     }
 }
 
@@ -81,15 +259,11 @@ void logError(const char* format, ...)
 void logSecurity(const char* format, ...) 
 {
     va_list arg;
-    char buffer[MAX_STRING];
 
     if (logCallback && format) {
         va_start(arg, format);
-        vsnprintf(buffer, sizeof(buffer), format, arg);
+        logMessage("SEC: %s", format, arg);
         va_end(arg);
-
-        buffer[MAX_STRING - 1] = 0; // safe string
-        logCallback("SEC: %s", buffer);        
     }
 }
 
@@ -100,18 +274,14 @@ void logSecurity(const char* format, ...)
  * \param  (...) null-terminated strings according to format
  * \return (void)
  */
-void logDebug(const char* format, ...) 
+void (logDebug)(const char* format, ...) 
 {
     va_list arg;
-    char buffer[MAX_STRING];
 
-    if (logCallback && format) {
+    if (logCallback && format && (RELAXED_LOAD(&logLevel) >= LOG_LEVEL_DEBUG)) {
         va_start(arg, format);
-        vsnprintf(buffer, sizeof(buffer), format, arg);
+        logMessage("External_plugin: %s", format, arg);
         va_end(arg);
-
-        buffer[MAX_STRING - 1] = 0; // safe string
-        logCallback("External_plugin: %s", buffer);
     }
 }
 
@@ -206,13 +376,298 @@ void freePluginConfig(avir_plugin_config *cfg)
     free(cfg);
 }
 
+#ifndef _WIN32
+/**
+ * Check that a directory is owned by this user or root and writable by nobody else
+ */
+static int isDirectorySafe(const char *directory, const char *description)
+{
+    struct stat sb;
+
+    if (0 != lstat(directory, &sb)) {
+        logError("Cannot check directory %s of %s", directory, description);
+        return 0;
+    }
+    if (!S_ISDIR(sb.st_mode) || ((sb.st_uid != geteuid()) && (sb.st_uid != 0)) || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        logError("Directory %s of %s must be owned by the server and writable only by it", directory, description);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+int openPrivateFile(const char *path, const char *description)
+{
+#ifdef _WIN32
+    logWarning("Cannot open %s %s, it is not supported on this platform", description, path);
+    return -1;
+#else
+    char directory[MAX_STRING];
+    const char *slash = strrchr(path, '/');
+    size_t length = slash ? (size_t) (slash - path) : 0;
+    struct stat sb;
+    int fd;
+
+    if (length >= sizeof(directory)) {
+        logError("Path of %s is too long", description);
+        return -1;
+    }
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    }
+    else if (length == 0) {
+        strcpy(directory, "/");
+    }
+    else {
+        memcpy(directory, path, length);
+        directory[length] = 0;
+    }
+
+    /* predictable names in a directory writable by others could be planted or swapped by another user */
+    if ((0 != mkdir(directory, 0700)) && (errno != EEXIST)) {
+        logError("Cannot create directory %s of %s", directory, description);
+        return -1;
+    }
+    if (!isDirectorySafe(directory, description)) {
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        logError("Cannot open %s %s", description, path);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if ((0 != fstat(fd, &sb)) || !S_ISREG(sb.st_mode) || (sb.st_uid != geteuid()) || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        logError("File %s (%s) must be a regular file owned by the server and writable only by it", path, description);
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+/**
+ * Value of "VerdictCacheSize" option in megabytes, 0 when the plugin does not define it
+ * 
+ * \return (unsigned long) size in bytes
+ */
+static unsigned long getVerdictCacheSize(void)
+{
+    unsigned int i;
+    long size;
+
+    for (i = 0; plugin_config[i].name[0]; i++) {
+        if (stricmp("VerdictCacheSize", plugin_config[i].name) == 0) {
+            size = atol(plugin_config[i].value);
+            return (size > 0) ? (unsigned long) size * 1024 * 1024 : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Value of "LogQueueSize" option, 0 when the plugin does not define it
+ * 
+ * \return (unsigned int) count of queued log messages
+ */
+static unsigned int getLogQueueSize(void)
+{
+    unsigned int i;
+    long size;
+
+    for (i = 0; plugin_config[i].name[0]; i++) {
+        if (stricmp("LogQueueSize", plugin_config[i].name) == 0) {
+            size = atol(plugin_config[i].value);
+            return (size > 0) ? (unsigned int) size : 0;
+        }
+    }
+    return 0;
+}
+
 /**
- * Store log_callback, and let the plugin do the rest of initialization.
+ * Read "LogLevel" and "LogLevelFile" options
+ * 
+ * \return (void)
+ */
+static void loadLogLevel(void)
+{
+    unsigned int i;
+
+    configuredLogLevel = LOG_LEVEL_DEBUG;
+    logLevelFile[0] = 0;
+    for (i = 0; plugin_config[i].name[0]; i++) {
+        if (stricmp("LogLevel", plugin_config[i].name) == 0) {
+            configuredLogLevel = parseLogLevel(plugin_config[i].value, LOG_LEVEL_DEBUG);
+        }
+        else if (stricmp("LogLevelFile", plugin_config[i].name) == 0) {
+            strncpy(logLevelFile, plugin_config[i].value, sizeof(logLevelFile) - 1);
+            logLevelFile[sizeof(logLevelFile) - 1] = 0;
+        }
+    }
+    RELAXED_STORE(&logLevel, configuredLogLevel);
+    logReloadLevel();
+}
+
+void logReloadLevel(void)
+{
+    int level = configuredLogLevel;
+    char value[16];
+    FILE *file;
+    size_t length;
+
+    if (logLevelFile[0] && ((file = fopen(logLevelFile, "r")) != NULL)) {
+        if (fgets(value, sizeof(value), file)) {
+            length = strlen(value);
+            while ((length > 0) && ((value[length - 1] == '\n') || (value[length - 1] == '\r') || (value[length - 1] == ' '))) {
+                value[--length] = 0;
+            }
+            level = parseLogLevel(value, configuredLogLevel);
+        }
+        fclose(file);
+    }
+    if (level != RELAXED_LOAD(&logLevel)) {
+        RELAXED_STORE(&logLevel, level);
+        if (logCallback) {
+            logLine("External_plugin: %s", "Log level has been changed to %s", logLevelNames[level]);
+        }
+    }
+}
+
+/**
+ * Store log_callback, start log queue, create verdict cache and let the plugin do the rest of initialization.
  */
 int pluginInitWrapper(AV_LOG_CALLBACK_NEW log_callback) 
 {
     logCallback = log_callback;
-    return pluginInit();
+    loadLogLevel();
+    if (!logQueueStart(log_callback, getLogQueueSize())) {
+        logWarning("Cannot start log queue, messages are logged synchronously");
+    }
+    if (!verdictCacheInit(getVerdictCacheSize())) {
+        logQueueStop();
+        return 0;
+    }
+    if (!pluginInit()) {
+        verdictCacheClose();
+        scanJournalClose();
+        logQueueStop();
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Let the plugin close, wait for scans still inside verdict cache or scan journal, drop verdict cache, 
+ * close scan journal and deliver queued log messages.
+ */
+int pluginCloseWrapper(void) 
+{
+    int result;
+
+    WRAPPER_INCREMENT(&wrapperClosing);
+    result = pluginClose();
+    while (wrapperScans > 0) {
+        WRAPPER_SLEEP();
+    }
+    verdictCacheClose();
+    scanJournalClose();
+    logQueueStop();
+    WRAPPER_DECREMENT(&wrapperClosing);
+    return result;
+}
+
+/**
+ * Enter verdict cache and scan journal, they are not closed until the scan leaves
+ * 
+ * \return (int) 0 if they are being closed, the scan must not use them
+ */
+static int enterWrapper(void)
+{
+    WRAPPER_INCREMENT(&wrapperScans);
+    if (wrapperClosing) {
+        WRAPPER_DECREMENT(&wrapperScans);
+        return 0;
+    }
+    return 1;
+}
+
+int getScannedFile(unsigned long long *size)
+{
+    if (size) {
+        *size = scannedFile.size;
+    }
+    return scannedFile.fd;
+}
+
+/**
+ * Open the checked file once, so that the path is looked up only once and verdict cache, the plugin 
+ * and scan journal all see the same file. O_NONBLOCK keeps open() of a FIFO from blocking, anything 
+ * but a regular file is left to the plugin.
+ * 
+ * \param filename (const char *) checked file
+ * \param sb (struct stat *) status of the open file
+ * \return (int) descriptor, -1 if the file cannot be opened or it is not a regular file
+ */
+static int openScannedFile(const char *filename, struct stat *sb)
+{
+    int fd = open(filename, O_RDONLY | O_BINARY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    if ((0 != fstat(fd, sb)) || !S_ISREG(sb->st_mode)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Answer from verdict cache or from concurrent scan of the same content,
+ * or let the plugin check the file and remember its verdict. Every scan is recorded in scan journal.
+ */
+int testFileWrapper(void *context,
+        const char *filename,
+        const char *realname,
+        char *reserved, unsigned int reserved_size,
+        char *vir_info, unsigned int vi_size)
+{
+    unsigned long long start = scanJournalClock();
+    avCacheKey key;
+    struct stat sb;
+    int result;
+    int cache;
+
+    if ((filename == NULL) || !enterWrapper()) {
+        return testFile(context, filename, realname, reserved, reserved_size, vir_info, vi_size);
+    }
+    scannedFile.fd = openScannedFile(filename, &sb);
+    scannedFile.size = (scannedFile.fd != -1) ? (unsigned long long) sb.st_size : 0;
+
+    result = verdictCacheLookup(scannedFile.fd, &sb, &key, vir_info, vi_size);
+    if (result >= 0) {
+        logDebug("Verdict of %s has been found in cache", filename);
+        cache = AVJOURNAL_CACHE_HIT;
+    }
+    else if ((result = verdictCacheJoin(&key, vir_info, vi_size)) >= 0) {
+        logDebug("Verdict of %s has been shared with concurrent scan of the same content", filename);
+        cache = AVJOURNAL_CACHE_SHARED;
+    }
+    else {
+        scanJournalBegin();
+        result = testFile(context, filename, realname, reserved, reserved_size, vir_info, vi_size);
+        verdictCacheStore(&key, result, vir_info);
+        cache = AVJOURNAL_SCANNED;
+    }
+    scanJournalWrite(filename, realname, scannedFile.size, result, cache, start);
+
+    if (scannedFile.fd != -1) {
+        close(scannedFile.fd);
+        scannedFile.fd = -1;
+    }
+    WRAPPER_DECREMENT(&wrapperScans);
+    return result;
 }
 
 /**
@@ -233,14 +688,14 @@ extern DLL_EXPORT avir_plugin_extended_thread_iface* get_plugin_extended_iface(u
         getPluginConfig,
         freePluginConfig,
         pluginInitWrapper,
-        pluginClose,
+        pluginCloseWrapper,
         NULL,
         NULL,
         NULL,
         NULL,
         threadInit,
         threadClose,
-        testFile
+        testFileWrapper
     };
 
     *version = 2;
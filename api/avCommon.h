@@ -32,6 +32,21 @@ extern avir_plugin_config plugin_config[];
  */
 extern char errorMessage[MAX_STRING];
 
+/**
+ * Log levels, messages above the current level are skipped before they are formatted.
+ * Errors and security events are logged at every level.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_DEBUG 2
+
+/**
+ * Highest level compiled in, e.g. -DLOG_LEVEL_MAX=1 removes all logDebug calls from the plugin
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
 /**
  * Debug logging functions to log debug events
  */
@@ -41,25 +56,46 @@ __attribute__((format(printf, 1, 2)))
 #endif
 ;
 
+/**
+ * Rate of messages of one call site of logError() or logWarning(), zero-initialized static variable
+ */
+typedef struct _avLogRate {
+    volatile unsigned int windowStart;
+    volatile unsigned int count;
+    volatile unsigned int suppressed;
+} avLogRate;
+
 /**
  * Error logging functions to log error events
  * Adds "ERR: " prefix to message
+ * The logError() macro keeps a rate of its call site, a storm of errors from one place is suppressed
+ * without affecting other messages. The function form shares one rate among all its callers.
  */
 void logError(const char* format, ...)
 #ifdef __GNUC__
 __attribute__((format(printf, 1, 2)))
 #endif
 ;
+void logErrorAt(avLogRate *rate, const char* format, ...)
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+;
 
 /**
  * Warning logging functions to log warning events
- * Adds "WAR: " prefix to message
+ * Adds "WAR: " prefix to message, rate limited per call site like logError()
  */
 void logWarning(const char* format, ...)
 #ifdef __GNUC__
 __attribute__((format(printf, 1, 2)))
 #endif
 ;
+void logWarningAt(avLogRate *rate, const char* format, ...)
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+;
 
 /**
  * Security logging functions to log security events
@@ -71,6 +107,44 @@ __attribute__((format(printf, 1, 2)))
 #endif
 ;
 
+/* calls above LOG_LEVEL_MAX are still type checked, but the optimizer drops them with their arguments */
+#if LOG_LEVEL_MAX < LOG_LEVEL_DEBUG
+#define logDebug(...) do { if (0) (logDebug)(__VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL_MAX < LOG_LEVEL_WARNING
+#define logWarning(...) do { if (0) (logWarning)(__VA_ARGS__); } while (0)
+#else
+#define logWarning(...) do { static avLogRate logSiteRate; logWarningAt(&logSiteRate, __VA_ARGS__); } while (0)
+#endif
+#define logError(...) do { static avLogRate logSiteRate; logErrorAt(&logSiteRate, __VA_ARGS__); } while (0)
+
+/**
+ * Re-read log level from the file named by "LogLevelFile" option, the level of "LogLevel" option
+ * applies while the file does not exist. Plugins with a maintenance thread should call it every few seconds.
+ */
+void logReloadLevel(void);
+
+/**
+ * Descriptor of the file being checked by testFile() in the calling thread. The wrapper opens the file once,
+ * so that the plugin reads the same file the verdict cache has hashed and does not look the path up again.
+ * The plugin must not close the descriptor, nor rely on its file position.
+ *
+ * \param size set to size of the file, may be NULL
+ * \return descriptor of a regular file, -1 if the wrapper has not opened the file (the plugin opens it itself)
+ */
+int getScannedFile(unsigned long long *size);
+
+/**
+ * Open (or create) a data file of the server, e.g. verdict cache file or scan journal. A missing directory
+ * of the file is created. The directory must be owned by the server's user or root, the file by the server's
+ * user, neither may be writable by others and the file must not be a symbolic link.
+ *
+ * \param path file name
+ * \param description what the file is, e.g. "verdict cache file", for log messages
+ * \return descriptor open for reading and writing, -1 on failure (it has been logged)
+ */
+int openPrivateFile(const char *path, const char *description);
+
 /**
  * Returns a copy of plugin_config.
  * Allocated configuration copy will released with freePluginConfig(cfg) call
@@ -0,0 +1,227 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Scan journal used by avCommon.c, see avJournal.h.
+ * Include this file in your plugin's project.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "avApi.h"
+#include "avCommon.h"
+#include "avJournal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define JOURNAL_THREAD __declspec(thread)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#define JOURNAL_THREAD __thread
+#endif
+
+/**
+ * Details of the running scan noted by the plugin, one per thread
+ */
+typedef struct _avScanNote {
+    char backend[20];
+    unsigned int phases[AVJOURNAL_PHASES];
+    unsigned char flags;
+} avScanNote;
+
+static JOURNAL_THREAD avScanNote scanNote;
+
+/**
+ * Mapped journal, valid while journalRecords is not NULL
+ */
+static avJournalHeader *journalHeader = NULL;
+static avScanRecord *journalRecords = NULL;
+static unsigned int journalCount = 0;
+static size_t journalSize = 0;
+static int journalFile = -1;
+
+#ifndef _WIN32
+/**
+ * Create or resize the journal, the file must be locked exclusively
+ *
+ * \param alone non-zero if no other process has the file open
+ */
+static int prepareJournalFile(int fd, const char *path, unsigned int recordCount, int alone)
+{
+    avJournalHeader header;
+    struct stat sb;
+
+    if (0 != fstat(fd, &sb)) {
+        return 0;
+    }
+    if ((sb.st_size >= AVJOURNAL_HEADER_SIZE) && (pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+            (0 == memcmp(header.magic, AVJOURNAL_MAGIC, sizeof(header.magic))) && (header.format == AVJOURNAL_FORMAT) &&
+            (header.recordSize == sizeof(avScanRecord)) && (header.recordCount > 0) &&
+            (sb.st_size == (off_t) AVJOURNAL_HEADER_SIZE + (off_t) header.recordCount * sizeof(avScanRecord)) &&
+            (alone ? (header.recordCount == recordCount) : 1)) {
+        return 1;
+    }
+    if (!alone) {
+        logError("Scan journal file %s is damaged and it is used by another process", path);
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AVJOURNAL_MAGIC, sizeof(header.magic));
+    header.format = AVJOURNAL_FORMAT;
+    header.recordSize = sizeof(avScanRecord);
+    header.recordCount = recordCount;
+    if ((0 != ftruncate(fd, 0)) || (0 != ftruncate(fd, (off_t) AVJOURNAL_HEADER_SIZE + (off_t) recordCount * sizeof(avScanRecord))) ||
+            (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))) {
+        logError("Cannot create scan journal file %s", path);
+        return 0;
+    }
+    logDebug("Scan journal file %s has been created", path);
+    return 1;
+}
+#endif
+
+int scanJournalOpen(const char *path, unsigned long size)
+{
+#ifdef _WIN32
+    logWarning("Scan journal is not supported on this platform");
+    return 0;
+#else
+    unsigned int recordCount;
+    struct stat sb;
+    void *base;
+    int alone;
+    int fd;
+
+    scanJournalClose();
+    if ((path == NULL) || (path[0] == 0) || (size <= AVJOURNAL_HEADER_SIZE)) {
+        return 1;
+    }
+    recordCount = (unsigned int) ((size - AVJOURNAL_HEADER_SIZE) / sizeof(avScanRecord));
+
+    fd = openPrivateFile(path, "scan journal file");
+    if (fd < 0) {
+        return 0;
+    }
+
+    /* the process which has the file alone may create or resize it, records of earlier runs are kept */
+    alone = (0 == flock(fd, LOCK_EX | LOCK_NB));
+    if (!alone && (0 != flock(fd, LOCK_EX))) {
+        close(fd);
+        return 0;
+    }
+    if (!prepareJournalFile(fd, path, recordCount, alone) || (0 != fstat(fd, &sb))) {
+        close(fd);
+        return 0;
+    }
+    base = mmap(NULL, (size_t) sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        logError("Cannot map scan journal file %s", path);
+        close(fd);
+        return 0;
+    }
+
+    /* shared lock is held while the file is mapped, so that nobody recreates it under our hands */
+    flock(fd, LOCK_SH);
+    journalHeader = (avJournalHeader *) base;
+    journalCount = journalHeader->recordCount;
+    journalSize = (size_t) sb.st_size;
+    journalFile = fd;
+    journalRecords = (avScanRecord *) ((char *) base + AVJOURNAL_HEADER_SIZE);
+    logDebug("Scan journal file %s with %u records is open", path, journalCount);
+    return 1;
+#endif
+}
+
+void scanJournalClose(void)
+{
+#ifndef _WIN32
+    if (journalRecords == NULL) {
+        return;
+    }
+    journalRecords = NULL;
+    journalCount = 0;
+    munmap(journalHeader, journalSize);
+    close(journalFile);
+    journalHeader = NULL;
+    journalSize = 0;
+    journalFile = -1;
+#endif
+}
+
+unsigned long long scanJournalClock(void)
+{
+#ifdef _WIN32
+    FILETIME now;
+
+    GetSystemTimeAsFileTime(&now);
+    return ((((unsigned long long) now.dwHighDateTime << 32) | now.dwLowDateTime) / 10000) - 11644473600000ULL;
+#else
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (unsigned long long) now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+void scanJournalBegin(void)
+{
+    memset(&scanNote, 0, sizeof(scanNote));
+}
+
+void scanJournalNote(const char *backend, unsigned int queueTime, unsigned int uploadTime, unsigned int verdictTime,
+        int hedged)
+{
+    strncpy(scanNote.backend, backend ? backend : "", sizeof(scanNote.backend));
+    scanNote.phases[0] = queueTime;
+    scanNote.phases[1] = uploadTime;
+    scanNote.phases[2] = verdictTime;
+    scanNote.flags = hedged ? AVJOURNAL_HEDGED : 0;
+}
+
+void scanJournalWrite(const char *filename, const char *realname, unsigned long long size, int result, int cache, 
+        unsigned long long start)
+{
+#ifndef _WIN32
+    avScanRecord *record;
+    unsigned long long now;
+    unsigned int number;
+
+    if ((journalRecords == NULL) || (filename == NULL)) {
+        return;
+    }
+    now = scanJournalClock();
+
+    number = __sync_fetch_and_add(&journalHeader->next, 1);
+    record = &journalRecords[number % journalCount];
+    record->sequence = number * 2 + 1;
+    __sync_synchronize();
+
+    record->extension = scanJournalExtensionHash((realname && realname[0]) ? realname : filename);
+    record->time = start;
+    record->size = size;
+    record->total = (now > start) ? (unsigned int) (now - start) : 0;
+    record->result = (unsigned char) result;
+    record->cache = (unsigned char) cache;
+    record->reserved = 0;
+    if (cache == AVJOURNAL_SCANNED) {
+        memcpy(record->phases, scanNote.phases, sizeof(record->phases));
+        memcpy(record->backend, scanNote.backend, sizeof(record->backend));
+        record->flags = scanNote.flags;
+    }
+    else {
+        memset(record->phases, 0, sizeof(record->phases));
+        memset(record->backend, 0, sizeof(record->backend));
+        record->flags = 0;
+    }
+
+    __sync_synchronize();
+    record->sequence = number * 2 + 2;
+#endif
+}
@@ -0,0 +1,197 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Scan journal used by avCommon.c around testFile() of the plugin.
+ *
+ * Every scan, also one answered by the verdict cache, leaves a fixed-size binary record in a memory-mapped
+ * ring file: time, file size, hash of file name extension, verdict, whether the verdict came from the cache,
+ * total time and times of scan phases reported by the plugin. Writers take slots by an atomic counter and
+ * write them under per-slot sequence locks, so scanning threads never wait for each other; the file may be
+ * shared by several processes and it is never synced. Records are read by the avjournal tool.
+ */
+
+#ifndef KERIO_AVJOURNAL_H
+#define KERIO_AVJOURNAL_H
+
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Identification and format version of the journal file
+ */
+#define AVJOURNAL_MAGIC "KAVJOURN"
+#define AVJOURNAL_FORMAT 1
+
+/**
+ * Offset of the first record, the header occupies one page
+ */
+#define AVJOURNAL_HEADER_SIZE 4096
+
+/**
+ * Count of scan phases timed by the plugin: waiting for connection, upload, waiting for verdict
+ */
+#define AVJOURNAL_PHASES 3
+
+/**
+ * Source of the verdict
+ */
+#define AVJOURNAL_SCANNED 0
+#define AVJOURNAL_CACHE_HIT 1
+#define AVJOURNAL_CACHE_SHARED 2
+
+/**
+ * Longest extension which is hashed, longer ones are hashed as "long"
+ */
+#define AVJOURNAL_MAX_EXTENSION 16
+
+/**
+ * Functions defined in this header, shared by the writer and the reader tool
+ */
+#ifdef _MSC_VER
+#define AVJOURNAL_INLINE static __inline
+#else
+#define AVJOURNAL_INLINE static __inline__
+#endif
+
+/**
+ * Flags of a record
+ */
+#define AVJOURNAL_HEDGED 1
+
+/**
+ * Header of the journal file
+ */
+typedef struct _avJournalHeader {
+    char magic[8];
+    unsigned int format;
+    unsigned int recordSize;
+    unsigned int recordCount;
+
+    /**
+     * Count of records ever written (modulo 2^32), the next record goes to slot next % recordCount
+     */
+    volatile unsigned int next;
+} avJournalHeader;
+
+/**
+ * Record of one scan, 64 bytes. Sequence is odd while the record is being written, otherwise it is twice
+ * the number of the record plus two, so that a reader can tell records of different laps apart.
+ */
+typedef struct _avScanRecord {
+    volatile unsigned int sequence;
+
+    /**
+     * FNV-1a hash of lowercase extension of the real file name, 0 if it has none
+     */
+    unsigned int extension;
+
+    /**
+     * Milliseconds since the Epoch when the scan started
+     */
+    unsigned long long time;
+    unsigned long long size;
+
+    /**
+     * Milliseconds of the whole scan and of its phases
+     */
+    unsigned int total;
+    unsigned int phases[AVJOURNAL_PHASES];
+
+    unsigned char result;
+    unsigned char cache;
+    unsigned char flags;
+    unsigned char reserved;
+
+    /**
+     * Server which has scanned the file, truncated
+     */
+    char backend[20];
+} avScanRecord;
+
+/**
+ * Open (or create) the journal file. Existing file of different size is recreated only if no other process uses it.
+ * It may be called from pluginInit(), the file is closed by pluginClose() wrapper after running scans have finished.
+ *
+ * \param path file name, empty string disables the journal
+ * \param size size of the file in bytes
+ * \return 1 on success or if disabled, 0 on failure
+ */
+int scanJournalOpen(const char *path, unsigned long size);
+
+/**
+ * Unmap and close the journal file
+ */
+void scanJournalClose(void);
+
+/**
+ * Current time for scanJournalWrite()
+ *
+ * \return milliseconds since the Epoch
+ */
+unsigned long long scanJournalClock(void);
+
+/**
+ * Forget details noted by the plugin during the previous scan of the calling thread
+ */
+void scanJournalBegin(void);
+
+/**
+ * Note details of the scan running in the calling thread, they are written with its record. It may be called
+ * from testFile().
+ *
+ * \param backend server which has scanned the file
+ * \param queueTime milliseconds spent waiting for a connection
+ * \param uploadTime milliseconds spent sending the file
+ * \param verdictTime milliseconds spent waiting for the verdict
+ * \param hedged non-zero if the file was also sent to another server
+ */
+void scanJournalNote(const char *backend, unsigned int queueTime, unsigned int uploadTime, unsigned int verdictTime,
+        int hedged);
+
+/**
+ * Write record of a finished scan, does nothing if the journal is not open
+ *
+ * \param filename scanned file
+ * \param realname original name of the file, may be NULL
+ * \param size size of the file as opened for the scan, 0 if it could not be opened
+ * \param result check result code
+ * \param cache AVJOURNAL_SCANNED, AVJOURNAL_CACHE_HIT or AVJOURNAL_CACHE_SHARED
+ * \param start time from scanJournalClock() when the scan started
+ */
+void scanJournalWrite(const char *filename, const char *realname, unsigned long long size, int result, int cache, 
+        unsigned long long start);
+
+/**
+ * Hash of file name extension as stored in records
+ *
+ * \param name file name, e.g. "invoice.pdf"
+ * \return hash, 0 if there is no extension
+ */
+AVJOURNAL_INLINE unsigned int scanJournalExtensionHash(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    const char *slash = strrchr(name, '/');
+    unsigned int hash = 2166136261U;
+
+    if ((dot == NULL) || (dot[1] == 0) || (slash && (slash > dot))) {
+        return 0;
+    }
+    if (strlen(dot + 1) > AVJOURNAL_MAX_EXTENSION) {
+        dot = ".long";
+    }
+    for (dot++; *dot; dot++) {
+        hash ^= (unsigned char) tolower((unsigned char) *dot);
+        hash *= 16777619U;
+    }
+    return hash ? hash : 1;
+}
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif // KERIO_AVJOURNAL_H
@@ -0,0 +1,292 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * avjournal -- reader of scan journal written by avCommon.c, see avJournal.h.
+ *
+ * Usage: avjournal [-H] journal-file
+ *        avjournal -e extension
+ *
+ * Records are printed as CSV from the oldest one, -H prints histograms of scan times and file sizes instead.
+ * The journal is mapped, so it may be read while servers write it; records being written are read again.
+ * Option -e prints hash of an extension as it appears in the extension column.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "avApi.h"
+#include "avJournal.h"
+
+/**
+ * Count of histogram buckets, bucket i holds values from 2^(i-1) to 2^i - 1
+ */
+#define HISTOGRAM_BUCKETS 40
+
+/**
+ * Width of the longest histogram bar
+ */
+#define HISTOGRAM_WIDTH 50
+
+/**
+ * Attempts to copy a record which is being written, a record still odd or changing after them is skipped
+ */
+#define COPY_ATTEMPTS 100
+
+/**
+ * Histogram with power-of-two buckets
+ */
+typedef struct _histogram {
+    const char *title;
+    const char *unit;
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+} histogram;
+
+/**
+ * Name of check result code
+ */
+static const char *resultName(unsigned int result)
+{
+    switch (result) {
+    case AVCHK_FAILED:
+        return "failed";
+    case AVCHK_OK:
+        return "clean";
+    case AVCHK_VIRUS_FOUND:
+        return "virus";
+    case AVCHK_IMPOSSIBLE:
+        return "impossible";
+    case AVCHK_ERROR:
+        return "error";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * Name of verdict source
+ */
+static const char *cacheName(unsigned int cache)
+{
+    switch (cache) {
+    case AVJOURNAL_SCANNED:
+        return "scanned";
+    case AVJOURNAL_CACHE_HIT:
+        return "cached";
+    case AVJOURNAL_CACHE_SHARED:
+        return "shared";
+    default:
+        return "unknown";
+    }
+}
+
+static void addValue(histogram *h, unsigned long long value)
+{
+    unsigned int bucket = 0;
+
+    while ((value > 0) && (bucket < HISTOGRAM_BUCKETS - 1)) {
+        value >>= 1;
+        bucket++;
+    }
+    h->counts[bucket]++;
+    h->total++;
+}
+
+static void printHistogram(const histogram *h)
+{
+    unsigned long largest = 0;
+    unsigned long sum = 0;
+    unsigned int first = HISTOGRAM_BUCKETS;
+    unsigned int last = 0;
+    unsigned int i;
+    int j;
+
+    printf("%s (%lu records)\n", h->title, h->total);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->counts[i]) {
+            largest = (h->counts[i] > largest) ? h->counts[i] : largest;
+            first = (i < first) ? i : first;
+            last = i;
+        }
+    }
+    for (i = first; (i <= last) && (i < HISTOGRAM_BUCKETS); i++) {
+        unsigned long long low = i ? (1ULL << (i - 1)) : 0;
+        int width = (int) ((h->counts[i] * HISTOGRAM_WIDTH + largest - 1) / largest);
+        sum += h->counts[i];
+        printf("  < %12llu %-2s %10lu %6.2f%% ", i ? (low << 1) : 1, h->unit, h->counts[i], 100.0 * sum / h->total);
+        for (j = 0; j < width; j++) {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+    putchar('\n');
+}
+
+/**
+ * Map the journal for reading, the caller unmaps it. Running servers keep writing into the mapping.
+ */
+static avJournalHeader *mapJournal(const char *path, size_t *size)
+{
+    avJournalHeader *header;
+    struct stat sb;
+    void *base;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return NULL;
+    }
+    if ((0 != fstat(fd, &sb)) || (sb.st_size < AVJOURNAL_HEADER_SIZE)) {
+        fprintf(stderr, "%s is not a scan journal\n", path);
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return NULL;
+    }
+
+    header = (avJournalHeader *) base;
+    if ((0 != memcmp(header->magic, AVJOURNAL_MAGIC, sizeof(header->magic))) || (header->format != AVJOURNAL_FORMAT) ||
+            (header->recordSize != sizeof(avScanRecord)) || (header->recordCount == 0) ||
+            ((size_t) sb.st_size != AVJOURNAL_HEADER_SIZE + (size_t) header->recordCount * sizeof(avScanRecord))) {
+        fprintf(stderr, "%s is not a scan journal of format %d\n", path, AVJOURNAL_FORMAT);
+        munmap(base, (size_t) sb.st_size);
+        return NULL;
+    }
+    *size = (size_t) sb.st_size;
+    return header;
+}
+
+/**
+ * Copy a record consistently. A record being written is copied again after its writer has finished.
+ *
+ * \return 1 if the copy is a complete record, 0 if the record has never been written, is torn by a crash
+ * or keeps changing
+ */
+static int copyRecord(const avScanRecord *record, avScanRecord *copy)
+{
+    unsigned int sequence;
+    int attempt;
+
+    for (attempt = 0; attempt < COPY_ATTEMPTS; attempt++) {
+        sequence = record->sequence;
+        if (sequence == 0) {
+            return 0;
+        }
+        if (!(sequence & 1)) {
+            __sync_synchronize();
+            memcpy(copy, (const void *) record, sizeof(*copy));
+            __sync_synchronize();
+            if (record->sequence == sequence) {
+                return 1;
+            }
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+static void printRecord(const avScanRecord *record)
+{
+    char backend[sizeof(record->backend) + 1];
+    char stamp[32];
+    time_t seconds = (time_t) (record->time / 1000);
+    struct tm local;
+
+    memcpy(backend, record->backend, sizeof(record->backend));
+    backend[sizeof(record->backend)] = 0;
+    localtime_r(&seconds, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    printf("%s.%03u,%llu,%08x,%s,%s,%s,%d,%u,%u,%u,%u\n", stamp, (unsigned int) (record->time % 1000), record->size,
+            record->extension, backend, resultName(record->result), cacheName(record->cache),
+            (record->flags & AVJOURNAL_HEDGED) ? 1 : 0, record->total, record->phases[0], record->phases[1], record->phases[2]);
+}
+
+int main(int argc, char **argv)
+{
+    histogram histograms[] = {
+        {"Scan time of all scans", "ms"},
+        {"Scan time of cached or shared verdicts", "ms"},
+        {"Scan time of scanned files", "ms"},
+        {"Waiting for connection", "ms"},
+        {"Upload", "ms"},
+        {"Waiting for verdict", "ms"},
+        {"File size", "B"}
+    };
+    unsigned long results[6];
+    avJournalHeader *header;
+    avScanRecord *records;
+    avScanRecord record;
+    int histogramMode = 0;
+    unsigned int next;
+    unsigned int i;
+    size_t size;
+
+    if ((argc == 3) && (0 == strcmp(argv[1], "-e"))) {
+        char name[MAX_STRING];
+        snprintf(name, sizeof(name), ".%s", argv[2]);
+        printf("%08x\n", scanJournalExtensionHash(name));
+        return 0;
+    }
+    if ((argc == 3) && (0 == strcmp(argv[1], "-H"))) {
+        histogramMode = 1;
+    }
+    else if (argc != 2) {
+        fprintf(stderr, "Usage: %s [-H] journal-file\n       %s -e extension\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    header = mapJournal(argv[argc - 1], &size);
+    if (header == NULL) {
+        return 1;
+    }
+    records = (avScanRecord *) ((char *) header + AVJOURNAL_HEADER_SIZE);
+    memset(results, 0, sizeof(results));
+
+    if (!histogramMode) {
+        printf("time,size,extension,backend,result,cache,hedged,total_ms,queue_ms,upload_ms,verdict_ms\n");
+    }
+
+    /* the slot of the next record holds the oldest one */
+    next = header->next;
+    for (i = 0; i < header->recordCount; i++) {
+        if (!copyRecord(&records[(next + i) % header->recordCount], &record)) {
+            continue;
+        }
+        if (!histogramMode) {
+            printRecord(&record);
+            continue;
+        }
+        results[(record.result < 6) ? record.result : 0]++;
+        addValue(&histograms[0], record.total);
+        addValue(&histograms[(record.cache == AVJOURNAL_SCANNED) ? 2 : 1], record.total);
+        if (record.cache == AVJOURNAL_SCANNED) {
+            addValue(&histograms[3], record.phases[0]);
+            addValue(&histograms[4], record.phases[1]);
+            addValue(&histograms[5], record.phases[2]);
+        }
+        addValue(&histograms[6], record.size);
+    }
+
+    if (histogramMode) {
+        printf("Results: %lu clean, %lu virus, %lu impossible, %lu error, %lu failed\n\n", results[AVCHK_OK],
+                results[AVCHK_VIRUS_FOUND], results[AVCHK_IMPOSSIBLE], results[AVCHK_ERROR], results[AVCHK_FAILED]);
+        for (i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++) {
+            if (histograms[i].total) {
+                printHistogram(&histograms[i]);
+            }
+        }
+    }
+    munmap(header, size);
+    return 0;
+}
@@ -0,0 +1,287 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Asynchronous log delivery used by avCommon.c, see avLog.h.
+ * Include this file in your plugin's project.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avApi.h"
+#include "avLog.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/**
+ * Largest count of queued messages
+ */
+#define LOG_MAX_RECORDS 65536
+
+/**
+ * Seconds of rate limiting window, and count of messages of one call site logged in it
+ */
+#define LOG_RATE_WINDOW 10
+#define LOG_RATE_LIMIT 10
+
+/**
+ * One queued message. The slot belongs to a producer when its sequence equals the enqueue position
+ * and to the log thread when it is one higher, see Vyukov's bounded MPMC queue.
+ */
+typedef struct _avLogRecord {
+    volatile unsigned int sequence;
+    const char *prefix;
+    char text[MAX_STRING];
+} avLogRecord;
+
+static avLogRecord *logRing = NULL;
+static unsigned int logMask = 0;
+static volatile unsigned int enqueuePosition = 0;
+static unsigned int dequeuePosition = 0;
+
+/**
+ * Messages dropped because the ring was full, reported by the log thread
+ */
+static volatile unsigned int logDropped = 0;
+
+/**
+ * Whether producers may use the ring, and count of producers using it right now
+ */
+static volatile int logRunning = 0;
+static volatile int logProducers = 0;
+
+static volatile int logStopping = 0;
+static pthread_t logThread;
+static AV_LOG_CALLBACK_NEW logTarget = NULL;
+
+/**
+ * The log thread sleeps on the condition while there is nothing to deliver. A producer takes the lock
+ * and signals only when it sees logSleeping set, i.e. when the queue has just stopped being empty.
+ */
+static pthread_mutex_t logWakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;
+static volatile int logSleeping = 0;
+
+/**
+ * Pass queued messages to the log callback
+ *
+ * \return count of delivered messages
+ */
+static unsigned int drainRecords(void)
+{
+    unsigned int count = 0;
+    unsigned int dropped;
+
+    for (;;) {
+        avLogRecord *record = &logRing[dequeuePosition & logMask];
+        if ((int) (record->sequence - (dequeuePosition + 1)) < 0) {
+            break; // empty, or the producer is still writing the message
+        }
+        __sync_synchronize();
+        logTarget(record->prefix, record->text);
+        __sync_synchronize();
+        record->sequence = dequeuePosition + logMask + 1;
+        dequeuePosition++;
+        count++;
+    }
+
+    dropped = __sync_lock_test_and_set(&logDropped, 0);
+    if (dropped) {
+        logTarget("WRN: %u log messages have been dropped, the log queue is full", dropped);
+    }
+    return count;
+}
+
+/**
+ * Whether the log thread has a message, a count of dropped messages or a stop request to handle
+ */
+static int hasLogWork(void)
+{
+    avLogRecord *record = &logRing[dequeuePosition & logMask];
+
+    return ((int) (record->sequence - (dequeuePosition + 1)) >= 0) || logDropped || logStopping;
+}
+
+/**
+ * Wake the log thread up if it sleeps, called after publishing a message or a stop request
+ */
+static void wakeLogThread(void)
+{
+    __sync_synchronize(); // the published message is visible before logSleeping is read
+    if (logSleeping) {
+        pthread_mutex_lock(&logWakeLock);
+        pthread_cond_signal(&logWake);
+        pthread_mutex_unlock(&logWakeLock);
+    }
+}
+
+/**
+ * Loop of the log thread, it delivers the rest of queued messages when it is stopped
+ */
+static void *logLoop(void *arg)
+{
+    for (;;) {
+        int stopping = logStopping;
+        if ((drainRecords() == 0) && stopping) {
+            break;
+        }
+
+        /* logSleeping is set before the queue is checked again, so a producer either sees it or its message is seen */
+        pthread_mutex_lock(&logWakeLock);
+        logSleeping = 1;
+        __sync_synchronize();
+        while (!hasLogWork()) {
+            pthread_cond_wait(&logWake, &logWakeLock);
+        }
+        logSleeping = 0;
+        pthread_mutex_unlock(&logWakeLock);
+    }
+    return NULL;
+}
+
+int logQueueStart(AV_LOG_CALLBACK_NEW callback, unsigned int records)
+{
+    unsigned int size = 1;
+    unsigned int i;
+
+    if (logRunning || (records == 0) || (callback == NULL)) {
+        return 1;
+    }
+    while ((size < records) && (size < LOG_MAX_RECORDS)) {
+        size <<= 1;
+    }
+
+    logRing = (avLogRecord *) malloc(sizeof(avLogRecord) * size);
+    if (logRing == NULL) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        logRing[i].sequence = i;
+    }
+    logMask = size - 1;
+    enqueuePosition = 0;
+    dequeuePosition = 0;
+    logDropped = 0;
+    logTarget = callback;
+    logStopping = 0;
+
+    if (0 != pthread_create(&logThread, NULL, logLoop, NULL)) {
+        free(logRing);
+        logRing = NULL;
+        return 0;
+    }
+    __sync_synchronize();
+    logRunning = 1;
+    return 1;
+}
+
+void logQueueStop(void)
+{
+    if (!logRunning) {
+        return;
+    }
+
+    /* producers which have seen the queue running finish their messages first */
+    logRunning = 0;
+    __sync_synchronize();
+    while (logProducers > 0) {
+        sched_yield();
+    }
+
+    logStopping = 1;
+    wakeLogThread();
+    pthread_join(logThread, NULL);
+    free(logRing);
+    logRing = NULL;
+}
+
+int logQueuePush(const char *prefix, const char *format, va_list arg)
+{
+    unsigned int position;
+    avLogRecord *record;
+
+    __sync_fetch_and_add(&logProducers, 1);
+    if (!logRunning) {
+        __sync_fetch_and_sub(&logProducers, 1);
+        return 0;
+    }
+
+    position = enqueuePosition;
+    for (;;) {
+        int distance;
+
+        record = &logRing[position & logMask];
+        distance = (int) (record->sequence - position);
+        if (distance == 0) {
+            if (__sync_bool_compare_and_swap(&enqueuePosition, position, position + 1)) {
+                break;
+            }
+            position = enqueuePosition;
+        }
+        else if (distance < 0) {
+            __sync_fetch_and_add(&logDropped, 1); // full, scanning threads never wait for the log
+            wakeLogThread();
+            __sync_fetch_and_sub(&logProducers, 1);
+            return 1;
+        }
+        else {
+            position = enqueuePosition;
+        }
+    }
+
+    record->prefix = prefix;
+    vsnprintf(record->text, sizeof(record->text), format, arg);
+    record->text[MAX_STRING - 1] = 0;
+    __sync_synchronize();
+    record->sequence = position + 1;
+    wakeLogThread();
+
+    __sync_fetch_and_sub(&logProducers, 1);
+    return 1;
+}
+
+int logRateAllow(avLogRate *rate, unsigned int *suppressed)
+{
+    unsigned int now = (unsigned int) time(NULL);
+    unsigned int start = rate->windowStart;
+
+    *suppressed = 0;
+    /* unsigned difference also restarts the window when the clock has been set back */
+    if ((now - start >= LOG_RATE_WINDOW) && __sync_bool_compare_and_swap(&rate->windowStart, start, now)) {
+        __sync_lock_test_and_set(&rate->count, 1);
+        *suppressed = __sync_lock_test_and_set(&rate->suppressed, 0);
+        return 1;
+    }
+    if (__sync_add_and_fetch(&rate->count, 1) <= LOG_RATE_LIMIT) {
+        return 1;
+    }
+    __sync_fetch_and_add(&rate->suppressed, 1);
+    return 0;
+}
+
+#else // _WIN32
+
+int logQueueStart(AV_LOG_CALLBACK_NEW callback, unsigned int records)
+{
+    return 1; // not supported, messages are logged synchronously
+}
+
+void logQueueStop(void)
+{
+}
+
+int logQueuePush(const char *prefix, const char *format, va_list arg)
+{
+    return 0;
+}
+
+int logRateAllow(avLogRate *rate, unsigned int *suppressed)
+{
+    *suppressed = 0;
+    return 1;
+}
+
+#endif
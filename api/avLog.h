@@ -0,0 +1,65 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * Asynchronous log delivery used by logging functions of avCommon.c.
+ *
+ * Scanning threads format their messages into a bounded lock-free ring (multiple producers, one consumer)
+ * and return immediately, a dedicated thread passes the messages to the log callback of the Kerio product
+ * in batches. The thread sleeps while the queue is empty, the producer of the first message wakes it up. A message which does not fit into a full ring is dropped and counted, the count is logged
+ * as a warning once the ring drains. The queue is enabled by "LogQueueSize" option (count of messages)
+ * in plugin_config, without it or on Windows messages are logged synchronously.
+ *
+ * Errors and warnings are also rate limited per call site, see logRateAllow().
+ */
+
+#ifndef KERIO_AVLOG_H
+#define KERIO_AVLOG_H
+
+#include <stdarg.h>
+#include "avApi.h"
+#include "avCommon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create the queue and start its thread
+ *
+ * \param callback log callback of the Kerio product
+ * \param records count of queued messages, rounded up to a power of two, 0 disables the queue
+ * \return 1 on success or if disabled, 0 on failure
+ */
+int logQueueStart(AV_LOG_CALLBACK_NEW callback, unsigned int records);
+
+/**
+ * Deliver all queued messages, stop the thread and free the queue, messages are logged synchronously again
+ */
+void logQueueStop(void);
+
+/**
+ * Queue a message
+ *
+ * \param prefix format passed to the log callback with the message, e.g. "ERR: %s"
+ * \param format printf-like format of the message
+ * \param arg arguments of format
+ * \return 1 if the message has been queued or dropped, 0 if the queue is not running and the caller
+ * must log the message itself
+ */
+int logQueuePush(const char *prefix, const char *format, va_list arg);
+
+/**
+ * Limit rate of messages of one call site, so that a storm of errors does not flood the log.
+ * At most a few messages of each call site are logged in a time window.
+ *
+ * \param rate state of the call site, see logError()
+ * \param suppressed count of messages of the call site suppressed in the previous window, reported by the caller
+ * \return 1 if the message may be logged, 0 if it is suppressed
+ */
+int logRateAllow(avLogRate *rate, unsigned int *suppressed);
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif // KERIO_AVLOG_H
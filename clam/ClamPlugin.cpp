@@ -5,11 +5,34 @@
  *
  */
 
+#ifdef _WIN32
+#   error The ClamAV plugin uses POSIX sockets, sendmsg() and poll() and does not build on Windows
+#endif
+
 #include <sys/stat.h>
-#include <fstream>
-#include <boost/filesystem.hpp>
-#include <boost/algorithm/string/trim.hpp>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#ifdef __linux__
+#   include <sys/sendfile.h>
+#   include <sys/epoll.h>
+#endif
 #include "avCommon.h"
+#include "avCache.h"
+#include "avJournal.h"
 #include "ClamPlugin.hpp"
 
 using namespace std;
@@ -27,9 +50,24 @@ using namespace std;
 #define MAX_TIMEOUT 100
 
 /**
- * Seconds between ping pong requests for keep alive thread
+ * Default seconds after which ClamAV Server closes idle connection, IdleTimeout of clamd
+ */
+#define DEFAULT_IDLE_TIMEOUT 30
+
+/**
+ * Idle sessions are pinged this many seconds before ClamAV Server would close them
+ */
+#define KEEPALIVE_MARGIN 5
+
+/**
+ * Maximal seconds between pool maintenance runs, i.e. replacing broken sessions
+ */
+#define MAINTENANCE_INTERVAL 5
+
+/**
+ * Seconds between VERSION checks, which detect signature updates for verdict cache
  */
-#define KEEPALIVE_TIMEOUT 60
+#define VERSION_CHECK_INTERVAL 60
 
 /**
  * Default port to contact ClamAV Server
@@ -37,46 +75,222 @@ using namespace std;
 #define DEFAULT_PORT "3310"
 
 /**
- * Specific answers from ClamAV Server
+ * Default count of connections opened at startup and kept open
  */
-const char encryptedMsg[] = "Encrypted";
-const char brokenMsg[] = "Broken";
-const char heuristicsEncryptedMsg[] = "Heuristics.Encrypted";
+#define DEFAULT_MIN_CONNECTIONS 2
 
-#ifdef _WIN32
+/**
+ * Default upper bound of connections shared by scanning threads
+ */
+#define DEFAULT_MAX_CONNECTIONS 16
 
-#ifndef stat
 /**
- *	Windows stat
+ * Maximum allowed count of connections
  */
-#   define stat _stati64
-#endif
+#define MAX_CONNECTIONS 256
+
+/**
+ * Default count of scans multiplexed on one connection
+ */
+#define DEFAULT_PIPELINE_DEPTH 4
+
+/**
+ * Default seconds after which an unused connection above minimum is closed
+ */
+#define DEFAULT_POOL_IDLE_TIME 120
+
+/**
+ * Default seconds between re-resolving of ClamAV Server addresses
+ */
+#define DEFAULT_RESOLVE_INTERVAL 300
+
+/**
+ * Default count of consecutive failed scans which opens circuit breaker of a ClamAV Server
+ */
+#define DEFAULT_BREAKER_THRESHOLD 5
+
+/**
+ * Default seconds for which a ClamAV Server with open circuit breaker is not used
+ */
+#define DEFAULT_BREAKER_OPEN_TIME 10
+
+/**
+ * Default seconds to connect to ClamAV Server
+ */
+#define DEFAULT_CONNECT_TIMEOUT 5
+
+/**
+ * Default upper bound in seconds of upload and verdict deadlines of one scan
+ */
+#define DEFAULT_SCAN_TIMEOUT 120
 
-#ifndef k_lstat
 /**
- * same as stat on windows, but lstat() on unixes
+ * Default size in megabytes of the persistent verdict cache file, and its upper bound.
+ * A 32-bit avserver has to fit both mapped files into its small address space.
  */
-#   define k_lstat _stati64
+#define DEFAULT_VERDICT_FILE_SIZE 64
+#ifdef BUILD_32BIT
+#   define MAX_VERDICT_FILE_SIZE 128
+#else
+#   define MAX_VERDICT_FILE_SIZE 1024
 #endif
 
+/**
+ * Default size in megabytes of the scan journal file (64 bytes per scan), and its upper bound
+ */
+#define DEFAULT_JOURNAL_FILE_SIZE 16
+#ifdef BUILD_32BIT
+#   define MAX_JOURNAL_FILE_SIZE 64
 #else
+#   define MAX_JOURNAL_FILE_SIZE 1024
+#endif
+
+/**
+ * Default seconds a scan waits at concurrency limit of a ClamAV Server, default size in kilobytes above which 
+ * files are refused at the limit by Shed policy, and default seconds between STATS checks
+ */
+#define DEFAULT_QUEUE_TIMEOUT 30
+#define DEFAULT_SHED_SIZE 1024
+#define DEFAULT_STATS_INTERVAL 10
 
-#ifndef k_lstat 
-#   define k_lstat lstat
-#endif /* k_lstat */
+/**
+ * Concurrency limit is lowered to this fraction on congestion, at most once per interval in milliseconds
+ */
+#define LIMIT_DECREASE 0.7
+#define LIMIT_DECREASE_INTERVAL 1000
 
-#endif
+/**
+ * Scan is considered congested when its verdict takes longer than this many milliseconds plus twice the time 
+ * predicted by measured throughput
+ */
+#define CONGESTION_BASE_TIME 1000
 
 /**
- * Atomic operations for Windows systems
+ * Default percentage of scans which may be hedged, and default percentile of verdict times at which a scan is hedged
  */
-#ifdef _WIN32
+#define DEFAULT_HEDGE_BUDGET 5
+#define DEFAULT_HEDGE_PERCENTILE 95
+
+/**
+ * Count of hedges which may be saved up by quiet periods
+ */
+#define HEDGE_BURST 10.0
+
+/**
+ * Verdict time histograms: size classes growing by factor of 4 from 64 kB, time bins growing by factor of 2^(1/4) 
+ * from 1 ms, count of scans after which a histogram is halved, and count of scans needed for percentiles
+ */
+#define LATENCY_SIZE_CLASSES 6
+#define LATENCY_SMALL_SIZE 65536
+#define LATENCY_BINS 96
+#define LATENCY_WINDOW 1000
+#define LATENCY_MIN_SAMPLES 50
+
+/**
+ * Milliseconds added to every upload and verdict deadline for latency of ClamAV Server
+ */
+#define UPLOAD_BASE_TIME 2000
+#define VERDICT_BASE_TIME 5000
 
-static inline int atomicInc(volatile int *a) {return _InterlockedIncrement(reinterpret_cast<volatile long *>(a));}
-static inline int atomicDec(volatile int *a) {return _InterlockedDecrement(reinterpret_cast<volatile long *>(a));}
-static inline int atomicGet(volatile int *a) {return _InterlockedCompareExchange(reinterpret_cast<volatile long *>(a), 0, 0);}
+/**
+ * Deadlines allow this many times longer transfer and scanning than measured throughput predicts
+ */
+#define DEADLINE_SLACK 4
+
+/**
+ * Throughput in bytes per millisecond assumed before it is measured, and its lower bound
+ */
+#define INITIAL_THROUGHPUT 4096.0
+#define MIN_THROUGHPUT 256.0
+
+/**
+ * Files smaller than this are dominated by latency and do not update measured throughput
+ */
+#define THROUGHPUT_SAMPLE_SIZE 262144
+
+/**
+ * Count of ClamAV Servers tried for one scan when connect fails
+ */
+#define MAX_BACKEND_ATTEMPTS 3
+
+/**
+ * Default count of scan replays after connection failure
+ */
+#define DEFAULT_SCAN_RETRIES 2
+
+/**
+ * Milliseconds of back-off between scan replays, multiplied by replay number
+ */
+#define RETRY_DELAY 100
+
+/**
+ * Bytes read from the beginning of a file to compute its affinity key
+ */
+#define AFFINITY_SAMPLE_SIZE 65536
+
+/**
+ * Default smallest sizes in kilobytes of files in medium and large lanes
+ */
+#define DEFAULT_MEDIUM_FILE_SIZE 1024
+#define DEFAULT_LARGE_FILE_SIZE 16384
+
+/**
+ * Percentage of concurrency limit reserved for small, medium and large lanes
+ */
+static const int laneShares[] = {50, 30, 20};
+
+/**
+ * Default size of INSTREAM chunks in kilobytes, and its upper bound
+ */
+#define DEFAULT_STREAM_CHUNK_SIZE 1024
+#define MAX_STREAM_CHUNK_SIZE 65536
+
+/**
+ * Streamed files of this size and larger are dropped from page cache after upload
+ */
+#define PAGE_CACHE_DROP_SIZE 1048576
 
-#else /* not Windows */
+/**
+ * Milliseconds to wait for the answer of ClamAV Server which has closed the connection during upload
+ */
+#define ANSWER_GRACE_TIME 1000
+
+/**
+ * Count of contexts of closed threads kept for reuse by new threads
+ */
+#define MAX_FREE_CONTEXTS 256
+
+/**
+ * Count of readable sessions the reactor takes from the kernel at once
+ */
+#define REACTOR_EVENTS 64
+
+/**
+ * Specific answers from ClamAV Server
+ */
+const char encryptedMsg[] = "Encrypted";
+const char brokenMsg[] = "Broken";
+const char heuristicsEncryptedMsg[] = "Heuristics.Encrypted";
+
+/**
+ * Answers from ClamAV Server to SCAN command when it cannot reach the file
+ */
+const char noSuchFileMsg[] = "No such file";
+const char permissionDeniedMsg[] = "Permission denied";
+const char accessDeniedMsg[] = "Access denied";
+
+/**
+ * Answer from ClamAV Server to INSTREAM command exceeding its StreamMaxLength
+ */
+const char sizeLimitMsg[] = "INSTREAM size limit exceeded";
+
+#ifndef O_NOFOLLOW
+#   define O_NOFOLLOW 0
+#endif
+
+#ifndef O_CLOEXEC
+#   define O_CLOEXEC 0
+#endif
 
 /**
  * Atomic operations for Unix systems
@@ -96,7 +310,118 @@ static inline int atomicGet(volatile int *a) {return exchange_and_add_function((
 #   error Only GCC is supported for atomic operations! __GNUC__ not defined.
 #endif /* gcc */
 
-#endif /* else not Windows */
+/**
+ * Check whether ClamAV Server answer means it cannot read the file by path
+ * 
+ * \param answer answer to SCAN command
+ * \return true when the file should be streamed instead
+ */
+static bool isAccessError(const std::string &answer)
+{
+    if ((answer.size() < 5) || (0 != answer.compare(answer.size() - 5, 5, "ERROR"))) {
+        return false;
+    }
+    return (answer.find(noSuchFileMsg) != std::string::npos) ||
+            (answer.find(permissionDeniedMsg) != std::string::npos) ||
+            (answer.find(accessDeniedMsg) != std::string::npos);
+}
+
+/**
+ * FNV-1a hash
+ * 
+ * \param data data to hash
+ * \param size size of data
+ * \param hash initial value, result of previous call to continue hashing
+ * \return hash
+ */
+static unsigned long long fnv1a(const void *data, size_t size, unsigned long long hash = 14695981039346656037ULL)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Mix bits of a value, used for random choices and rendezvous hashing
+ */
+static unsigned long long mix64(unsigned long long x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * Compute content key of a file from its size and leading bytes, identical files get identical keys
+ * 
+ * \param fd file descriptor
+ * \param size file size
+ * \param sample buffer of the thread context for leading bytes, grown to AFFINITY_SAMPLE_SIZE once
+ * \param key computed key
+ * \return true on success
+ */
+static bool affinityKey(int fd, unsigned long long size, std::vector<char> &sample, unsigned long long &key)
+{
+    if (sample.size() < AFFINITY_SAMPLE_SIZE) {
+        sample.resize(AFFINITY_SAMPLE_SIZE);
+    }
+    ssize_t count = pread(fd, &sample[0], sample.size(), 0);
+    if (count < 0) {
+        return false;
+    }
+    key = fnv1a(&sample[0], count, fnv1a(&size, sizeof(size)));
+    return true;
+}
+
+/**
+ * Split configured list of addresses separated by commas or spaces
+ * 
+ * \param list configured value
+ * \param addresses list of addresses
+ */
+static void splitAddresses(const std::string &list, std::vector<std::string> &addresses)
+{
+    std::string::size_type begin = 0;
+    while ((begin = list.find_first_not_of(", \t", begin)) != std::string::npos) {
+        std::string::size_type end = list.find_first_of(", \t", begin);
+        addresses.push_back(list.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+        begin = end;
+    }
+}
+
+/**
+ * Split one address to host and port: "host", "host:port", "IPv6" or "[IPv6]:port"
+ * 
+ * \param address configured address
+ * \param host host part
+ * \param port port part, unchanged when address has no port
+ */
+static void splitHostPort(const std::string &address, std::string &host, std::string &port)
+{
+    if (!address.empty() && (address[0] == '[')) {
+        std::string::size_type close = address.find(']');
+        host = address.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+        if ((close != std::string::npos) && (0 == address.compare(close + 1, 1, ":"))) {
+            port = address.substr(close + 2);
+        }
+        return;
+    }
+
+    std::string::size_type colon = address.find(':');
+    if ((colon != std::string::npos) && (address.find(':', colon + 1) == std::string::npos)) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    else {
+        host = address; // host name, IPv4 or IPv6 address without port
+    }
+}
 
 /**
  * Function for safe copy of null-terminated strings, function will copy string using strcpy and add additional Null character
@@ -116,311 +441,2452 @@ void strncpys(char *dest, const char *src, size_t size)
 	}
 }
 
-bool ClamPlugin::SyncStream::connect(std::string &server)
+/**
+ * Classify answer of ClamAV Server and write the verdict text straight to vir_info, nothing is allocated
+ * 
+ * \param answer answer without id, for example "OK", "Eicar-Test-Signature FOUND" or "INSTREAM size limit exceeded. ERROR"
+ * \param vir_info virus name or error message
+ * \param vi_size size of vir_info
+ * \return check result code, AVCHK_ERROR when the answer cannot be understood
+ */
+static int classifyAnswer(const std::string &answer, char *vir_info, unsigned int vi_size)
 {
-    std::string::size_type colon = server.find_last_of(':');
+    static const char foundMsg[] = " FOUND";
+    const char *text = answer.c_str();
 
-    stream->expires_from_now(boost::posix_time::seconds(this->timeout)); // set timeout
-    stream->connect(server.substr(0, colon), server.substr(colon + 1));
-    stream->expires_from_now(boost::posix_time::pos_infin); // reset timeout
+    if (answer == "OK") {
+        strncpys(vir_info, "Clean", vi_size);
+        return AVCHK_OK;
+    }
 
-    if (stream->bad() || (!stream->good())) {
-        return false;
+    const char *lastWord = strrchr(text, ' ');
+    if (lastWord == NULL) {
+        strncpys(vir_info, "Internal error", vi_size);
+        return AVCHK_ERROR;
     }
-    return true;
-}
+    int length = (int) (lastWord - text);
 
-bool ClamPlugin::SyncStream::sendString(const string &input)
-{
-    stream->expires_from_now(boost::posix_time::seconds(this->timeout)); // set timeout
-    if (stream && (!stream->fail())) {
-        *stream << "n" << input << endl;
-        stream->flush();
-        stream->expires_from_now(boost::posix_time::pos_infin); // reset timeout
+    if (0 == strcmp(lastWord, foundMsg)) {
+        snprintf(vir_info, vi_size, "%.*s", length, text);
 
-        if (!stream->fail()) {
-            return true;
+        /* check for special answers from server that indicates impossible file check */
+        if ((0 == strncmp(text, encryptedMsg, sizeof(encryptedMsg) - 1)) ||
+                (0 == strncmp(text, brokenMsg, sizeof(brokenMsg) - 1)) ||
+                (0 == strncmp(text, heuristicsEncryptedMsg, sizeof(heuristicsEncryptedMsg) - 1))) {
+            return AVCHK_IMPOSSIBLE;
         }
-    }    
-    return false;
+        return AVCHK_VIRUS_FOUND;
+    }
+
+    /* ERROR or anything else */
+    snprintf(vir_info, vi_size, "Scanning failed - ClamAV Server returns error: %.*s", length, text);
+    return AVCHK_FAILED;
 }
 
-bool ClamPlugin::SyncStream::sendFile(const string &file)
+/**
+ * Check whether answer of ClamAV Server is a verdict, i.e. the file is clean or infected, rather than an error
+ * 
+ * \param answer answer without id
+ * \return true for "OK" and "... FOUND"
+ */
+static bool isVerdict(const std::string &answer)
 {
-    stream->expires_from_now(boost::posix_time::seconds(this->timeout)); // set timeout
-    if (stream && (!stream->fail())) {
-        struct stat sb;
-        if (-1 != k_lstat(file.c_str(), &sb)) {
-            ifstream fstr(file.c_str(), ios::binary);
-            if (fstr.is_open() && (!fstr.fail())) {
-                unsigned int clamSize = (unsigned int) sb.st_size;
+    static const char foundMsg[] = " FOUND";
 
-                clamSize = htonl(clamSize);
-                stream->write((const char *) &clamSize, sizeof(unsigned int));
+    return (answer == "OK") || ((answer.size() >= sizeof(foundMsg) - 1) && 
+            (0 == answer.compare(answer.size() - (sizeof(foundMsg) - 1), sizeof(foundMsg) - 1, foundMsg)));
+}
 
-                if (fstr.good()) {
-                    *stream << fstr.rdbuf();
-                }
-                clamSize = 0; // Write last empty chunk according to API
-                stream->write((const char *) &clamSize, sizeof(unsigned int));
-                stream->flush();
-                stream->expires_from_now(boost::posix_time::pos_infin); // reset timeout
+/**
+ * Monotonic clock in milliseconds, used for socket deadlines
+ */
+static long long monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-                if (!stream->fail()) {
-                    return true;
-                }
-            }
-        }
-        stream->expires_from_now(boost::posix_time::pos_infin); // reset timeout
+/**
+ * Earlier of two times, negative time means never
+ * 
+ * \param a time from monotonic clock or negative value
+ * \param b time from monotonic clock or negative value
+ * \return earlier time or negative value if both are negative
+ */
+static long long earliest(long long a, long long b)
+{
+    if (a < 0) {
+        return b;
     }
-    return false;
+    return ((b < 0) || (a < b)) ? a : b;
 }
 
-bool ClamPlugin::SyncStream::readString(string &output, unsigned int *id)
+/**
+ * Wait until socket is ready or deadline passes
+ * 
+ * \param sock socket descriptor
+ * \param events POLLIN or POLLOUT
+ * \param deadline absolute deadline from monotonicMs(), negative value means no deadline
+ * \return true if socket is ready, false on timeout or error
+ */
+static bool waitSocket(int sock, short events, long long deadline)
 {
-    output.clear();
-    if (stream && stream->good()) {
-        getline(*stream, output);
-        boost::algorithm::trim(output);
-
-        string::size_type pos = output.find(":");
-        if (pos != string::npos) {
-            if (id) {
-                *id = atoi(output.c_str());
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = events;
+
+    for (;;) {
+        int wait = -1;
+        if (deadline >= 0) {
+            long long left = deadline - monotonicMs();
+            if (left <= 0) {
+                return false;
             }
-            output.erase(output.begin(), output.begin() + pos + 2); // Reply format --> "NUMBER: REPLY"
-        } 
-        else if (id) {
-            *id = 0;
+            wait = (int) left;
         }
-
-        pos = output.find("stream:");
-        if (pos == 0) {
-            output.erase(output.begin(), output.begin() + 8); // stream-reply format --> "NUMBER: stream: REPLY"
+        int rv = poll(&pfd, 1, wait);
+        if (rv > 0) {
+            return (0 == (pfd.revents & POLLNVAL)) && ((pfd.revents & events) || (0 == (pfd.revents & POLLERR)));
         }
-
-        if (!stream->fail()) {
-            return true;
-        } 
-        else {
-            output = "Connection to ClamAV Server has failed.";
+        if ((rv < 0) && (errno != EINTR)) {
             return false;
         }
-    } 
-    else {
-        output = "An error has occurred. Check your connection.";
-        return false;
     }
 }
 
-ClamPlugin::ClamPlugin()
-{
-    this->server.clear();
-    this->connVector.clear();
-    this->closing = false;
-    this->state = Closed;
-    this->runningThreads = 0;
-    this->pingThreadHandle = NULL;
-}
-
-ClamPlugin::~ClamPlugin()
+/**
+ * Write whole I/O vector to non-blocking socket
+ * 
+ * \param sock socket descriptor
+ * \param iov I/O vector, it is modified during writing
+ * \param count count of items in iov
+ * \param deadline absolute deadline from monotonicMs()
+ * \return true on success
+ */
+static bool writeAll(int sock, struct iovec *iov, int count, long long deadline)
 {
-    this->closing = true;
-
-    if (NULL != this->pingThreadHandle) {
-        this->pingThreadHandle->join();
-        delete this->pingThreadHandle;
-        this->pingThreadHandle = NULL;
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t written = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && waitSocket(sock, POLLOUT, deadline)) {
+                continue;
+            }
+            return false;
+        }
+        while ((count > 0) && ((size_t) written >= iov->iov_len)) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
+    return true;
 }
 
-int ClamPlugin::ThreadInit(void **context)
-{
-    *context = NULL;
-    
-    logDebug("Initializing context");
-    if (this->server.empty() || (context == NULL)) {
-        logDebug("Internal context error");
-        return 0;
+/**
+ * Blocks SIGPIPE in the calling thread for its lifetime, sendfile(2) has no MSG_NOSIGNAL flag 
+ * and server may close connection in the middle of upload
+ */
+class SigPipeGuard {
+    sigset_t pipeSet;
+    sigset_t oldSet;
+    bool pending;
+
+public:
+    SigPipeGuard() {
+        sigemptyset(&pipeSet);
+        sigaddset(&pipeSet, SIGPIPE);
+        sigset_t pendingSet;
+        sigpending(&pendingSet);
+        pending = (1 == sigismember(&pendingSet, SIGPIPE));
+        pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
     }
 
-    SyncStreamPtr connection(new SyncStream(timeout));
-    try {
-        if (!connection->connect(this->server)) {
-            strncpys(errorMessage, "Cannot connect to ClamAV Server.", MAX_STRING);
-            logError("Cannot connect to ClamAV Server on %s", this->server.c_str());
-            this->state = Failed;
-            return 0;
+    ~SigPipeGuard() {
+        if (!pending) {
+            /* consume SIGPIPE raised by us, so it is not delivered when the mask is restored */
+            struct timespec zero = {0, 0};
+            while ((sigtimedwait(&pipeSet, NULL, &zero) == -1) && (errno == EINTR)) {
+            }
         }
-    } 
+        pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+    }
+};
+
+#ifndef POSIX_FADV_SEQUENTIAL
+/**
+ * posix_fadvise(2) is not available, adviseFile() does nothing
+ */
+#   define NO_FADVISE
+#   define POSIX_FADV_SEQUENTIAL 2
+#   define POSIX_FADV_WILLNEED 3
+#   define POSIX_FADV_DONTNEED 4
+#endif
+
+/**
+ * Closes file descriptor when it goes out of scope
+ */
+class DescriptorGuard {
+    int fd;
+
+public:
+    DescriptorGuard(int _fd) 
+        :fd(_fd) {
+    }
+
+    ~DescriptorGuard() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+/**
+ * Give the kernel a hint about future access to a file range, no-op where posix_fadvise(2) is not available
+ * 
+ * \param fd file descriptor
+ * \param offset start of the range
+ * \param length length of the range, 0 means up to the end of the file
+ * \param advice POSIX_FADV_* constant
+ */
+static void adviseFile(int fd, off_t offset, off_t length, int advice)
+{
+#ifndef NO_FADVISE
+    (void) posix_fadvise(fd, offset, length, advice);
+#endif
+}
+
+/**
+ * Move file body to socket kernel-to-kernel using sendfile(2), falls back to read/write 
+ * when the file system does not support sendfile
+ * 
+ * \param sock socket descriptor
+ * \param fd file descriptor
+ * \param offset position in the file
+ * \param size count of bytes to send
+ * \param deadline absolute deadline from monotonicMs()
+ * \param missing set to count of bytes which could not be read from the file, 0 when the socket has failed
+ * \return true on success
+ */
+static bool sendFileBody(int sock, int fd, off_t offset, off_t size, long long deadline, off_t &missing)
+{
+    off_t end = offset + size;
+
+    missing = 0;
+
+#ifdef __linux__
+    SigPipeGuard guard;
+
+    while (offset < end) {
+        ssize_t sent = sendfile(sock, fd, &offset, (size_t) (end - offset));
+        if (sent > 0) {
+            continue;
+        }
+        if (sent == 0) {
+            missing = end - offset; // file was truncated meanwhile, announced length cannot be satisfied
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && waitSocket(sock, POLLOUT, deadline)) {
+            continue;
+        }
+        if ((errno != EINVAL) && (errno != ENOSYS)) {
+            return false;
+        }
+        break; // sendfile is not supported for this file, copy the rest through user space
+    }
+#endif
+
+    char buffer[16384];
+    while (offset < end) {
+        size_t toRead = (end - offset) < (off_t) sizeof(buffer) ? (size_t) (end - offset) : sizeof(buffer);
+        ssize_t count = pread(fd, buffer, toRead, offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            missing = end - offset;
+            return false;
+        }
+        struct iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = count;
+        if (!writeAll(sock, &iov, 1, deadline)) {
+            return false;
+        }
+        offset += count;
+    }
+    return true;
+}
+
+/**
+ * Send zero bytes in place of file data which could not be read, so that the announced INSTREAM chunk is complete
+ * 
+ * \param sock socket descriptor
+ * \param size count of bytes to send
+ * \param deadline absolute deadline from monotonicMs()
+ * \return true on success
+ */
+static bool sendPadding(int sock, off_t size, long long deadline)
+{
+    static const char zeros[16384] = {0};
+
+    while (size > 0) {
+        struct iovec iov;
+        iov.iov_base = (void *) zeros;
+        iov.iov_len = (size_t) std::min(size, (off_t) sizeof(zeros));
+        if (!writeAll(sock, &iov, 1, deadline)) {
+            return false;
+        }
+        size -= (off_t) iov.iov_len;
+    }
+    return true;
+}
+
+bool ClamPlugin::SyncStream::connect(std::string &server)
+{
+    close();
+    buffer.clear();
+
+    struct sockaddr_storage address;
+    socklen_t length;
+    memset(&address, 0, sizeof(address));
+    local = !server.empty() && (server[0] == '/');
+    if (local) {
+        struct sockaddr_un *path = (struct sockaddr_un *) &address;
+        if (server.size() >= sizeof(path->sun_path)) {
+            return false;
+        }
+        path->sun_family = AF_UNIX;
+        memcpy(path->sun_path, server.c_str(), server.size() + 1);
+        length = sizeof(*path);
+    }
+    else {
+        std::string::size_type colon = server.find_last_of(':');
+        struct addrinfo hints;
+        struct addrinfo *found = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        if ((colon == std::string::npos) ||
+                (0 != getaddrinfo(server.substr(0, colon).c_str(), server.substr(colon + 1).c_str(), &hints, &found))) {
+            return false;
+        }
+        memcpy(&address, found->ai_addr, found->ai_addrlen);
+        length = found->ai_addrlen;
+        freeaddrinfo(found);
+    }
+
+    /* the socket stays non-blocking, all I/O waits by poll(2) until its own deadline */
+    sock = socket(address.ss_family, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return false;
+    }
+    (void) fcntl(sock, F_SETFD, FD_CLOEXEC);
+    (void) fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    long long deadline = (timeout > 0) ? monotonicMs() + (long long) timeout * 1000 : -1;
+    if (0 != ::connect(sock, (struct sockaddr *) &address, length)) {
+        int error = errno;
+        socklen_t errorLength = sizeof(error);
+        if (((error != EINPROGRESS) && (error != EINTR)) || !waitSocket(sock, POLLOUT, deadline) ||
+                (0 != getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLength)) || (error != 0)) {
+            close();
+            return false;
+        }
+    }
+
+    /* command, chunks and end of INSTREAM are separate writes, Nagle would hold them until delayed ACK */
+    if (!local) {
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    return true;
+}
+
+bool ClamPlugin::SyncStream::isLocal() const
+{
+    return local;
+}
+
+void ClamPlugin::SyncStream::close()
+{
+    if (sock != -1) {
+        ::close(sock);
+        sock = -1;
+    }
+}
+
+int ClamPlugin::SyncStream::nativeHandle()
+{
+    return sock;
+}
+
+void ClamPlugin::SyncStream::shutdown()
+{
+    if (sock != -1) {
+        ::shutdown(sock, SHUT_RDWR);
+    }
+}
+
+bool ClamPlugin::SyncStream::sendString(const string &input)
+{
+    if (sock == -1) {
+        return false;
+    }
+
+    std::string line = "n" + input + "\n";
+    struct iovec iov;
+    iov.iov_base = (void *) line.data();
+    iov.iov_len = line.size();
+
+    return writeAll(nativeHandle(), &iov, 1, monotonicMs() + (long long) this->timeout * 1000);
+}
+
+bool ClamPlugin::SyncStream::sendFile(int fd, unsigned long long size, size_t chunkSize, long long deadline, 
+        Request *request, bool *fileError)
+{
+    if (fileError) {
+        *fileError = false;
+    }
+    if (sock == -1) {
+        return false;
+    }
+
+    static const char command[] = "nINSTREAM\n";
+    unsigned int lastChunk = 0; // Write last empty chunk according to API
+    int sock = nativeHandle();
+    off_t end = (off_t) size;
+    off_t offset = 0;
+    bool first = true;
+    bool result = true;
+    bool unreadable = false;
+
+    adviseFile(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* chunk lengths are 32-bit, clamd refuses the stream as soon as it exceeds StreamMaxLength */
+    while (result && (offset < end)) {
+        if (request && request->isDone()) {
+            result = false; // answered before the whole file has been sent
+            break;
+        }
+        off_t length = std::min((off_t) chunkSize, end - offset);
+        if (offset + length < end) {
+            adviseFile(fd, offset + length, (off_t) chunkSize, POSIX_FADV_WILLNEED); // read ahead while this one is sent
+        }
+        unsigned int clamSize = htonl((unsigned int) length);
+        struct iovec head[2];
+        int count = 0;
+        if (first) {
+            head[count].iov_base = (void *) command;
+            head[count].iov_len = sizeof(command) - 1;
+            count++;
+            first = false;
+        }
+        head[count].iov_base = &clamSize;
+        head[count].iov_len = sizeof(clamSize);
+        count++;
+        off_t missing = 0;
+        result = writeAll(sock, head, count, deadline) && sendFileBody(sock, fd, offset, length, deadline, missing);
+        if (!result && (missing > 0)) {
+            /* our own read has failed, finish the chunk and the stream so that the session stays usable */
+            unreadable = true;
+            result = sendPadding(sock, missing, deadline);
+            break;
+        }
+        offset += length;
+    }
+
+    if (result) {
+        struct iovec tail[2];
+        int count = 0;
+        if (first) {
+            tail[count].iov_base = (void *) command;
+            tail[count].iov_len = sizeof(command) - 1;
+            count++;
+        }
+        tail[count].iov_base = &lastChunk;
+        tail[count].iov_len = sizeof(lastChunk);
+        count++;
+        result = writeAll(sock, tail, count, deadline);
+    }
+
+    /* large attachments are read once, they must not push mail store out of page cache */
+    if (size >= PAGE_CACHE_DROP_SIZE) {
+        adviseFile(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (unreadable) {
+        if (fileError) {
+            *fileError = true;
+        }
+        return false;
+    }
+    return result;
+}
+
+bool ClamPlugin::SyncStream::sendDescriptor(int fd, long long deadline)
+{
+    if (!isLocal()) {
+        return false;
+    }
+    (void) lseek(fd, 0, SEEK_SET); // the descriptor is shared with clamd, which may have read it by a previous attempt
+
+    /* the same framing as clamdscan: command first, then one dummy byte carrying the descriptor */
+    static const char command[] = "nFILDES\n";
+    int sock = nativeHandle();
+    bool result = false;
+
+    struct iovec iov;
+    iov.iov_base = (void *) command;
+    iov.iov_len = sizeof(command) - 1;
+    if (!writeAll(sock, &iov, 1, deadline)) {
+        return false;
+    }
+
+    char dummy = 0;
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    for (;;) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent == 1) {
+            result = true;
+            break;
+        }
+        if ((sent < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) && waitSocket(sock, POLLOUT, deadline)) {
+            continue;
+        }
+        break;
+    }
+
+    return result;
+}
+
+bool ClamPlugin::SyncStream::query(const std::string &command, std::string &reply, long long deadline)
+{
+    reply.clear();
+    if (sock == -1) {
+        return false;
+    }
+
+    std::string line = "z" + command;
+    line += '\0';
+    struct iovec iov;
+    iov.iov_base = (void *) line.data();
+    iov.iov_len = line.size();
+    int sock = nativeHandle();
+    if (!writeAll(sock, &iov, 1, deadline)) {
+        return false;
+    }
+
+    /* z-prefixed command is answered by one NUL-terminated reply */
+    for (;;) {
+        std::string::size_type end = buffer.find('\0');
+        if (end != std::string::npos) {
+            reply.assign(buffer, 0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+        if (!waitSocket(sock, POLLIN, deadline)) {
+            return false;
+        }
+        char chunk[4096];
+        ssize_t count = recv(sock, chunk, sizeof(chunk), 0);
+        if (count > 0) {
+            buffer.append(chunk, count);
+        }
+        else if ((count == 0) || ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+            return false;
+        }
+    }
+}
+
+bool ClamPlugin::SyncStream::receive()
+{
+    if (sock == -1) {
+        return false;
+    }
+
+    int sock = nativeHandle();
+    for (;;) {
+        char chunk[4096];
+        ssize_t count = recv(sock, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (count > 0) {
+            buffer.append(chunk, count);
+            if ((size_t) count < sizeof(chunk)) {
+                return true;
+            }
+            continue;
+        }
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        return (count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+    }
+}
+
+bool ClamPlugin::SyncStream::nextReply(string &output, unsigned int *id)
+{
+    string::size_type eol = buffer.find('\n');
+    if (eol == string::npos) {
+        return false;
+    }
+
+    /* reply is parsed in place and copied once: "NUMBER: [stream: |fd[FD]: ]REPLY" */
+    const char *line = buffer.c_str();
+    size_t begin = 0;
+    size_t end = eol;
+    while ((begin < end) && isspace((unsigned char) line[begin])) {
+        begin++;
+    }
+    while ((end > begin) && isspace((unsigned char) line[end - 1])) {
+        end--;
+    }
+
+    const char *colon = (const char *) memchr(line + begin, ':', end - begin);
+    if (id) {
+        *id = colon ? (unsigned int) atoi(line + begin) : 0;
+    }
+    if (colon) {
+        begin = std::min((size_t) (colon - line) + 2, end);
+        if ((end - begin >= 8) && (0 == memcmp(line + begin, "stream: ", 8))) {
+            begin += 8;
+        }
+        else if ((end - begin >= 3) && (0 == memcmp(line + begin, "fd[", 3))) {
+            const char *bracket = (const char *) memchr(line + begin, ']', end - begin);
+            if (bracket && ((size_t) (bracket - line) + 3 <= end) && (0 == memcmp(bracket, "]: ", 3))) {
+                begin = (bracket - line) + 3;
+            }
+        }
+    }
+
+    output.assign(buffer, begin, end - begin);
+    buffer.erase(0, eol + 1);
+    return true;
+}
+
+void ClamPlugin::Request::reset(const char *_path)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    done = false;
+    failed = false;
+    verdict = false;
+    path = _path;
+    answer.clear();
+}
+
+void ClamPlugin::Request::complete(const std::string &reply, bool error)
+{
+    Request *waiter;
+    {
+        MutexType::scoped_lock lock(mutex);
+
+        answer = reply;
+        if (!error && path) {
+            size_t length = strlen(path);
+            if ((0 == answer.compare(0, length, path)) && (0 == answer.compare(length, 2, ": "))) {
+                answer.erase(0, length + 2); // scan-reply format --> "NUMBER: PATH: REPLY"
+            }
+        }
+        failed = error;
+        verdict = !error && isVerdict(answer);
+        done = true;
+        ready.notify_all();
+        waiter = partner; // the request may be gone once the lock is released
+    }
+
+    if (waiter) {
+        MutexType::scoped_lock lock(waiter->mutex);
+        waiter->ready.notify_all();
+    }
+}
+
+bool ClamPlugin::Request::expire(const char *error)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (done) {
+        return false;
+    }
+    answer = error;
+    failed = true;
+    done = true;
+    return true;
+}
+
+bool ClamPlugin::Request::wait(long long deadline)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    while (!done) {
+        if (deadline < 0) {
+            ready.wait(lock);
+            continue;
+        }
+        long long left = deadline - monotonicMs();
+        if ((left <= 0) || (!ready.timed_wait(lock, boost::posix_time::milliseconds(left)) && !done)) {
+            return false;
+        }
+    }
+    return !failed;
+}
+
+bool ClamPlugin::Request::waitEither(Request &other, long long deadline)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    for (;;) {
+        bool otherVerdict = false;
+        bool otherDone = other.isDone(NULL, &otherVerdict); // lock order: this, then partner
+        if ((done && !failed) || otherVerdict || (done && otherDone)) {
+            return true;
+        }
+        long long left = deadline - monotonicMs();
+        if (left <= 0) {
+            return false;
+        }
+        ready.timed_wait(lock, boost::posix_time::milliseconds(left));
+    }
+}
+
+bool ClamPlugin::Request::isDone(bool *succeeded, bool *hasVerdict)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (succeeded) {
+        *succeeded = done && !failed;
+    }
+    if (hasVerdict) {
+        *hasVerdict = done && verdict;
+    }
+    return done;
+}
+
+ClamPlugin::LatencyTracker::LatencyTracker()
+    :bins(LATENCY_SIZE_CLASSES * LATENCY_BINS, 0),totals(LATENCY_SIZE_CLASSES, 0)
+{
+}
+
+size_t ClamPlugin::LatencyTracker::getClass(unsigned long long size)
+{
+    size_t sizeClass = 0;
+    for (unsigned long long limit = LATENCY_SMALL_SIZE; (size >= limit) && (sizeClass < LATENCY_SIZE_CLASSES - 1); limit *= 4) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+void ClamPlugin::LatencyTracker::add(unsigned long long size, long long time)
+{
+    size_t bin = (size_t) (4.0 * std::log((double) std::max(time, 1LL)) / std::log(2.0));
+    bin = std::min(bin, (size_t) LATENCY_BINS - 1);
+    size_t sizeClass = getClass(size);
+    MutexType::scoped_lock lock(mutex);
+
+    /* old scans fade out, so that the percentile follows changing load */
+    if (totals[sizeClass] >= LATENCY_WINDOW) {
+        totals[sizeClass] = 0;
+        for (size_t i = 0; i < LATENCY_BINS; i++) {
+            bins[sizeClass * LATENCY_BINS + i] /= 2;
+            totals[sizeClass] += bins[sizeClass * LATENCY_BINS + i];
+        }
+    }
+    bins[sizeClass * LATENCY_BINS + bin]++;
+    totals[sizeClass]++;
+}
+
+long long ClamPlugin::LatencyTracker::getPercentile(unsigned long long size, int percentile)
+{
+    size_t sizeClass = getClass(size);
+    MutexType::scoped_lock lock(mutex);
+
+    if (totals[sizeClass] < LATENCY_MIN_SAMPLES) {
+        return -1;
+    }
+    unsigned long long wanted = ((unsigned long long) totals[sizeClass] * percentile + 99) / 100;
+    unsigned long long count = 0;
+    size_t bin = 0;
+    for (; bin < LATENCY_BINS - 1; bin++) {
+        count += bins[sizeClass * LATENCY_BINS + bin];
+        if (count >= wanted) {
+            break;
+        }
+    }
+    return (long long) std::ceil(std::pow(2.0, (bin + 1) / 4.0)); // upper bound of the bin
+}
+
+void ClamPlugin::HedgeBudget::setPercent(int percent)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    rate = percent / 100.0;
+    tokens = 0.0;
+}
+
+void ClamPlugin::HedgeBudget::earn()
+{
+    MutexType::scoped_lock lock(mutex);
+
+    tokens = std::min(HEDGE_BURST, tokens + rate);
+}
+
+bool ClamPlugin::HedgeBudget::spend()
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (tokens < 1.0) {
+        return false;
+    }
+    tokens -= 1.0;
+    return true;
+}
+
+ClamPlugin::Session::Session(int connectTimeout, int _replyTimeout, size_t _chunkSize, Reactor *_reactor)
+    :stream(new SyncStream(connectTimeout)),lastId(0),lastReply(0),lastActivity(monotonicMs()),replyTimeout(_replyTimeout),
+    chunkSize(_chunkSize),broken(false),reactor(_reactor),registered(false)
+{
+}
+
+ClamPlugin::Session::~Session()
+{
+    close();
+}
+
+bool ClamPlugin::Session::open(std::string &server)
+{
+    try {
+        if (!stream->connect(server)) {
+            logError("Cannot connect to ClamAV Server on %s", server.c_str());
+            broken = true;
+            return false;
+        }
+    } 
+    catch (std::exception &e) {
+        logError("Cannot connect to ClamAV Server, error: %s", e.what());
+        broken = true;
+        return false;
+    }
+
+    logDebug("Sending SESSION command...");
+    if (!stream->sendString("IDSESSION")) {
+        logError("Cannot initiate session at the ClamAV Server");
+        broken = true;
+        return false;
+    }
+
+    if (!reactor->add(this, stream->nativeHandle())) {
+        logError("Unable to watch ClamAV Server session.");
+        broken = true;
+        return false;
+    }
+    registered = true;
+    return true;
+}
+
+void ClamPlugin::Session::close()
+{
+    if (!registered) {
+        return;
+    }
+
+    if (!broken) {
+        MutexType::scoped_lock lock(writeMutex);
+        logDebug("Sending END command...");
+        if (!stream->sendString("END")) {
+            logWarning("Cannot destroy session at the ClamAV Server");
+        }
+    }
+    fail("Session to ClamAV Server has been closed.");
+
+    reactor->remove(this); // no reply is dispatched once it returns
+    registered = false;
+}
+
+unsigned int ClamPlugin::Session::enqueue(Request &request)
+{
+    MutexType::scoped_lock lock(pendingMutex);
+
+    unsigned int id = ++lastId;
+    pending.push_back(std::make_pair(id, &request));
+    request.id = id;
+    request.submitted = monotonicMs();
+    lastActivity = request.submitted;
+    return id;
+}
+
+ClamPlugin::Request *ClamPlugin::Session::takePending(unsigned int id)
+{
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i].first == id) {
+            Request *request = pending[i].second;
+            pending[i] = pending.back();
+            pending.pop_back();
+            return request;
+        }
+    }
+    return NULL;
+}
+
+void ClamPlugin::Session::cancel(unsigned int id)
+{
+    MutexType::scoped_lock lock(pendingMutex);
+
+    (void) takePending(id);
+}
+
+void ClamPlugin::Session::fail(const std::string &error)
+{
+    MutexType::scoped_lock lock(pendingMutex);
+
+    broken = true;
+    stream->shutdown();
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].second->complete(error, true);
+    }
+    pending.clear();
+}
+
+bool ClamPlugin::Session::submit(Request &request, const std::string &command)
+{
+    MutexType::scoped_lock lock(writeMutex);
+
+    if (broken) {
+        return false;
+    }
+    unsigned int id = enqueue(request);
+    if (!stream->sendString(command)) {
+        cancel(id);
+        fail("Connection to ClamAV Server has failed.");
+        return false;
+    }
+    return true;
+}
+
+bool ClamPlugin::Session::submitFile(Request &request, int fd, unsigned long long size, long long deadline, 
+        bool *fileError)
+{
+    MutexType::scoped_lock lock(writeMutex);
+
+    if (fileError) {
+        *fileError = false;
+    }
+    if (broken) {
+        return false;
+    }
+    unsigned int id = enqueue(request);
+    bool result;
+    bool unreadable = false;
+    if (stream->isLocal()) {
+        result = stream->sendDescriptor(fd, deadline); // clamd reads the file itself, no data cross the socket
+    }
+    else {
+        result = stream->sendFile(fd, size, chunkSize, deadline, &request, &unreadable);
+    }
+    if (unreadable) {
+        /* the stream has been completed with padding, clamd answers it and the reply to cancelled id is dropped */
+        cancel(id);
+        (void) request.expire("The scanned file cannot be read.");
+        if (fileError) {
+            *fileError = true;
+        }
+        return false;
+    }
+    if (!result) {
+        /* clamd answers a refused upload (StreamMaxLength) right away and closes the connection */
+        bool answered = !stream->isLocal() && request.wait(std::min(deadline, monotonicMs() + ANSWER_GRACE_TIME));
+        if (!answered) {
+            cancel(id);
+        }
+        fail("Connection to ClamAV Server has failed.");
+        return answered;
+    }
+    return true;
+}
+
+bool ClamPlugin::Session::await(Request &request, long long deadline, bool *expired)
+{
+    if (expired) {
+        *expired = false;
+    }
+    if (request.wait(deadline)) {
+        return true;
+    }
+
+    /* the reactor cannot complete withdrawn request, so expire() below decides the race */
+    bool stuck;
+    {
+        MutexType::scoped_lock lock(pendingMutex);
+        (void) takePending(request.id);
+        stuck = (lastReply <= request.submitted);
+    }
+    if (!request.expire("ClamAV Server has not answered in time.")) {
+        return request.wait(); // completed meanwhile
+    }
+
+    if (expired) {
+        *expired = true;
+    }
+    if (stuck && !broken) {
+        logWarning("ClamAV Server has not answered in time, its session is closed");
+        fail("Connection to ClamAV Server has timed out.");
+    }
+    return false;
+}
+
+void ClamPlugin::Session::withdraw(Request &request)
+{
+    cancel(request.id);
+    (void) request.expire("Scan has been answered by another ClamAV Server.");
+}
+
+bool ClamPlugin::Session::isBroken() const
+{
+    return broken;
+}
+
+long long ClamPlugin::Session::getIdleSince()
+{
+    MutexType::scoped_lock lock(pendingMutex);
+
+    return pending.empty() ? lastActivity : -1;
+}
+
+void ClamPlugin::Session::dispatch()
+{
+    bool connected = stream->receive();
+    unsigned int id = 0;
+
+    /* replies received before end of stream are dispatched too, e.g. refused INSTREAM */
+    while (stream->nextReply(reply, &id)) {
+        MutexType::scoped_lock lock(pendingMutex);
+
+        lastReply = monotonicMs();
+        lastActivity = lastReply;
+        Request *request = (id != 0) ? takePending(id) : NULL;
+        if (request) {
+            request->complete(reply, false);
+        }
+        else if (id == 0) {
+            logError("Unexpected answer from ClamAV Server session: '%s'", reply.c_str());
+            connected = false;
+            break;
+        }
+    }
+    if (!connected) {
+        fail("Connection to ClamAV Server has failed.");
+        reactor->remove(this);
+    }
+}
+
+bool ClamPlugin::Session::getVersion(std::string &version)
+{
+    Request request;
+
+    logDebug("Sending VERSION command...");
+    if (!submit(request, "VERSION")) {
+        logWarning("Cannot send VERSION command to the ClamAV Server");
+        version = "unknown";
+        return true;
+    }
+    if (!await(request, monotonicMs() + (long long) replyTimeout * 1000)) {
+        version = request.answer;
+        logDebug("Cannot read response from ClamAV Server session, error: %s", version.c_str());
+        return false;
+    }
+    version = request.answer;
+    return true;
+}
+
+bool ClamPlugin::Session::sendPingPong(std::string &error)
+{
+    Request request;
+
+    logDebug("Sending PING command...");
+    if (!submit(request, "PING")) {
+        error = "Cannot send PING command";
+        logWarning("%s", error.c_str());
+        return false;
+    }
+
+    if (!await(request, monotonicMs() + (long long) replyTimeout * 1000)) {
+        error = "Cannot read response from ClamAV Server session.";
+        logError("%s", error.c_str());
+        return false;
+    }
+    if (request.answer != "PONG") {
+        error = "An incorrect answer has been received from ClamAV Server '" + request.answer + "'.";
+        logError("%s", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+ClamPlugin::Reactor::Reactor()
+    :current(NULL),thread(NULL),stopping(false),pollFd(-1)
+{
+    wakeFds[0] = -1;
+    wakeFds[1] = -1;
+}
+
+ClamPlugin::Reactor::~Reactor()
+{
+    stop();
+}
+
+bool ClamPlugin::Reactor::start()
+{
+    if (thread != NULL) {
+        return true;
+    }
+
+    if (-1 == pipe(wakeFds)) {
+        wakeFds[0] = -1;
+        wakeFds[1] = -1;
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        (void) fcntl(wakeFds[i], F_SETFD, FD_CLOEXEC);
+        (void) fcntl(wakeFds[i], F_SETFL, O_NONBLOCK);
+    }
+
+#ifdef __linux__
+    pollFd = epoll_create(REACTOR_EVENTS);
+    if (pollFd != -1) {
+        (void) fcntl(pollFd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL; // the wake pipe
+        if (-1 == epoll_ctl(pollFd, EPOLL_CTL_ADD, wakeFds[0], &event)) {
+            ::close(pollFd);
+            pollFd = -1;
+        }
+    }
+    if (pollFd == -1) {
+        stop();
+        return false;
+    }
+#endif
+
+    stopping = false;
+    try {
+        thread = new boost::thread(boost::bind(&Reactor::run, this)); // boost::thread_resource_error can be thrown
+    }
+    catch (std::exception &e) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void ClamPlugin::Reactor::stop()
+{
+    if (thread != NULL) {
+        stopping = true;
+        wake();
+        thread->join();
+        delete thread;
+        thread = NULL;
+    }
+
+    MutexType::scoped_lock lock(mutex);
+
+    if (pollFd != -1) {
+        ::close(pollFd);
+        pollFd = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (wakeFds[i] != -1) {
+            ::close(wakeFds[i]);
+            wakeFds[i] = -1;
+        }
+    }
+}
+
+void ClamPlugin::Reactor::wake()
+{
+    char byte = 0;
+    if (wakeFds[1] != -1) {
+        (void) write(wakeFds[1], &byte, 1); // a full pipe wakes the loop up as well
+    }
+}
+
+bool ClamPlugin::Reactor::add(Session *session, int fd)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (thread == NULL) {
+        return false;
+    }
+#ifdef __linux__
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (-1 == epoll_ctl(pollFd, EPOLL_CTL_ADD, fd, &event)) {
+        return false;
+    }
+#endif
+    sessions.push_back(std::make_pair(session, fd));
+#ifndef __linux__
+    wake(); // poll the new socket too
+#endif
+    return true;
+}
+
+void ClamPlugin::Reactor::remove(Session *session)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].first == session) {
+#ifdef __linux__
+            if (pollFd != -1) {
+                struct epoll_event event; // ignored, but required by kernels before 2.6.9
+                (void) epoll_ctl(pollFd, EPOLL_CTL_DEL, sessions[i].second, &event);
+            }
+#endif
+            sessions[i] = sessions.back();
+            sessions.pop_back();
+            break;
+        }
+    }
+
+    /* the session is removed from its own dispatch when the connection fails */
+    if ((thread != NULL) && (boost::this_thread::get_id() != thread->get_id())) {
+        while (current == session) {
+            dispatched.wait(lock);
+        }
+    }
+}
+
+void ClamPlugin::Reactor::dispatch(Session *session)
+{
+    {
+        MutexType::scoped_lock lock(mutex);
+
+        bool registered = false;
+        for (size_t i = 0; !registered && (i < sessions.size()); i++) {
+            registered = (sessions[i].first == session);
+        }
+        if (!registered) {
+            return; // removed after the event has been reported
+        }
+        current = session;
+    }
+
+    session->dispatch();
+
+    MutexType::scoped_lock lock(mutex);
+    current = NULL;
+    dispatched.notify_all();
+}
+
+void ClamPlugin::Reactor::run()
+{
+#ifdef __linux__
+    struct epoll_event events[REACTOR_EVENTS];
+#else
+    std::vector<struct pollfd> fds;
+    std::vector<Session *> polled;
+#endif
+
+    while (!stopping) {
+        bool woken = false;
+#ifdef __linux__
+        int count = epoll_wait(pollFd, events, REACTOR_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                woken = true;
+                continue;
+            }
+            dispatch((Session *) events[i].data.ptr);
+        }
+#else
+        fds.clear();
+        polled.clear();
+        {
+            MutexType::scoped_lock lock(mutex);
+
+            struct pollfd wakeFd = { wakeFds[0], POLLIN, 0 };
+            fds.push_back(wakeFd);
+            for (size_t i = 0; i < sessions.size(); i++) {
+                struct pollfd sessionFd = { sessions[i].second, POLLIN, 0 };
+                fds.push_back(sessionFd);
+                polled.push_back(sessions[i].first);
+            }
+        }
+        int count = poll(&fds[0], fds.size(), -1);
+        woken = (count > 0) && (fds[0].revents != 0);
+        for (size_t i = 1; (count > 0) && (i < fds.size()); i++) {
+            if (fds[i].revents != 0) {
+                dispatch(polled[i - 1]);
+            }
+        }
+#endif
+        if (woken) {
+            char drain[64];
+            while (read(wakeFds[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+}
+
+ClamPlugin::CircuitBreaker::CircuitBreaker(int _threshold, int _openTime)
+    :state(BreakerClosed),threshold(_threshold),openTime(_openTime),failures(0),openUntil(0),probing(false)
+{
+}
+
+bool ClamPlugin::CircuitBreaker::allow(long long now)
+{
+    if (state == BreakerOpen) {
+        if (now < openUntil) {
+            return false;
+        }
+        state = BreakerHalfOpen;
+        probing = false;
+    }
+    if (state == BreakerHalfOpen) {
+        if (probing) {
+            return false;
+        }
+        probing = true;
+    }
+    return true;
+}
+
+bool ClamPlugin::CircuitBreaker::isAllowed(long long now) const
+{
+    if (state == BreakerOpen) {
+        return now >= openUntil;
+    }
+    return (state == BreakerClosed) || !probing;
+}
+
+bool ClamPlugin::CircuitBreaker::isClosed() const
+{
+    return state == BreakerClosed;
+}
+
+bool ClamPlugin::CircuitBreaker::isProbeDue(long long now) const
+{
+    return (state == BreakerOpen) && (now >= openUntil);
+}
+
+long long ClamPlugin::CircuitBreaker::getProbeTime() const
+{
+    return (state == BreakerOpen) ? openUntil : -1;
+}
+
+bool ClamPlugin::CircuitBreaker::success()
+{
+    bool changed = (state != BreakerClosed);
+    state = BreakerClosed;
+    failures = 0;
+    probing = false;
+    return changed;
+}
+
+bool ClamPlugin::CircuitBreaker::failure(long long now, bool trip)
+{
+    if (state == BreakerOpen) {
+        return false; // late result of scan started before opening
+    }
+    failures++;
+    if (!trip && (state == BreakerClosed) && (failures < threshold)) {
+        return false;
+    }
+    bool changed = (state == BreakerClosed);
+    state = BreakerOpen;
+    openUntil = now + (long long) openTime * 1000;
+    failures = 0;
+    probing = false;
+    return changed;
+}
+
+ClamPlugin::ConcurrencyLimiter::ConcurrencyLimiter(size_t initial, size_t maximum)
+    :limit((double) std::min(initial, maximum)),maxLimit((double) maximum),lastDecrease(0)
+{
+}
+
+size_t ClamPlugin::ConcurrencyLimiter::getLimit() const
+{
+    return (size_t) limit;
+}
+
+void ClamPlugin::ConcurrencyLimiter::grow(size_t load)
+{
+    /* about one more scan per limit answered scans */
+    if ((double) load + 1.0 >= limit) {
+        limit = std::min(maxLimit, limit + 1.0 / limit);
+    }
+}
+
+bool ClamPlugin::ConcurrencyLimiter::shrink(long long now)
+{
+    if ((now - lastDecrease < LIMIT_DECREASE_INTERVAL) || (limit <= 1.0)) {
+        return false;
+    }
+    limit = std::max(1.0, limit * LIMIT_DECREASE);
+    lastDecrease = now;
+    return true;
+}
+
+ClamPlugin::Pool::Pool(const std::string &_server, const PoolConfig &_config)
+    :server(_server),config(_config),opening(0),closed(false),breaker(_config.breakerThreshold, _config.breakerOpenTime),
+    uploadRate(INITIAL_THROUGHPUT),scanRate(INITIAL_THROUGHPUT),
+    limiter(_config.minSize * _config.depth, _config.maxSize * _config.depth),streamLimit(_config.streamLimit)
+{
+    for (int lane = 0; lane < LaneCount; lane++) {
+        laneLoad[lane] = 0;
+    }
+}
+
+size_t ClamPlugin::Pool::countLoad() const
+{
+    size_t load = opening;
+    for (std::vector<Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+        load += i->leases;
+    }
+    return load;
+}
+
+ClamPlugin::Lane ClamPlugin::Pool::getLane(unsigned long long size) const
+{
+    if (size >= config.largeSize) {
+        return LaneLarge;
+    }
+    return (size >= config.mediumSize) ? LaneMedium : LaneSmall;
+}
+
+size_t ClamPlugin::Pool::getReserve(Lane lane) const
+{
+    size_t reserve = limiter.getLimit() * laneShares[lane] / 100;
+    return (reserve > 0) ? reserve : 1;
+}
+
+bool ClamPlugin::Pool::isAdmitted(Lane lane) const
+{
+    size_t load = countLoad();
+    size_t limit = limiter.getLimit();
+    if (load >= limit) {
+        return false;
+    }
+    if (laneLoad[lane] < getReserve(lane)) {
+        return true;
+    }
+
+    /* above its reserve the lane may only borrow capacity the other lanes do not use */
+    size_t unused = 0;
+    for (int other = 0; other < LaneCount; other++) {
+        size_t reserve = getReserve((Lane) other);
+        if ((other != lane) && (laneLoad[other] < reserve)) {
+            unused += reserve - laneLoad[other];
+        }
+    }
+    return load + unused < limit;
+}
+
+ClamPlugin::Lane ClamPlugin::Pool::getSparseLane() const
+{
+    size_t count[LaneCount] = {0};
+    for (std::vector<Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+        count[i->lane]++;
+    }
+
+    int sparse = LaneSmall;
+    for (int lane = 1; lane < LaneCount; lane++) {
+        if (count[lane] < count[sparse]) {
+            sparse = lane;
+        }
+    }
+    return (Lane) sparse;
+}
+
+ClamPlugin::SessionPtr ClamPlugin::Pool::grow(bool leased, Lane lane)
+{
+    SessionPtr session(new Session(config.connectTimeout, config.timeout, config.chunkSize, config.reactor));
+    bool result = session->open(server);
+
+    MutexType::scoped_lock lock(mutex);
+    opening--;
+    if (!result && breaker.failure(monotonicMs(), true)) {
+        logWarning("Cannot connect to ClamAV Server %s, it will not be used for %d seconds", server.c_str(), 
+                config.breakerOpenTime);
+    }
+    if (!result || closed) {
+        released.notify_all(); // waiters may open the connection themselves
+        return SessionPtr();
+    }
+
+    Entry entry;
+    entry.session = session;
+    entry.leases = leased ? 1 : 0;
+    entry.lastUsed = monotonicMs();
+    entry.lane = lane;
+    entries.push_back(entry);
+    if (!leased) {
+        released.notify_all();
+    }
+    return session;
+}
+
+size_t ClamPlugin::Pool::fill()
+{
+    for (;;) {
+        Lane lane;
+        {
+            MutexType::scoped_lock lock(mutex);
+            if (closed || (entries.size() + opening >= config.minSize) || !breaker.isClosed()) {
+                return entries.size();
+            }
+            opening++;
+            lane = getSparseLane();
+        }
+        if (!grow(false, lane)) {
+            MutexType::scoped_lock lock(mutex);
+            return entries.size();
+        }
+    }
+}
+
+ClamPlugin::SessionPtr ClamPlugin::Pool::lease(const unsigned long long *size, bool *overloaded, bool *shed)
+{
+    {
+        MutexType::scoped_lock lock(mutex);
+        if (!breaker.allow(monotonicMs())) {
+            return SessionPtr(); // fail fast rather than wait for connect timeout
+        }
+    }
+    return acquire(true, size, overloaded, shed);
+}
+
+ClamPlugin::SessionPtr ClamPlugin::Pool::tryLease(unsigned long long size)
+{
+    {
+        MutexType::scoped_lock lock(mutex);
+        if (closed || !breaker.isClosed()) {
+            return SessionPtr();
+        }
+    }
+    bool overloaded = false;
+    return acquire(false, &size, &overloaded);
+}
+
+ClamPlugin::SessionPtr ClamPlugin::Pool::acquire(bool wait, const unsigned long long *size, bool *overloaded, 
+        bool *shed)
+{
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(config.timeout);
+    boost::system_time queueDeadline = boost::get_system_time() + boost::posix_time::seconds(config.queueTimeout);
+    bool canGrow = true;
+    bool scan = (size != NULL);
+    Lane lane = scan ? getLane(*size) : LaneSmall;
+    MutexType::scoped_lock lock(mutex);
+
+    while (!closed) {
+        /* scans above concurrency limit of their lane wait in queue, or they are refused right away */
+        if (scan && !isAdmitted(lane)) {
+            if (!wait || (config.shed && (*size > config.shedSize))) {
+                if (overloaded) {
+                    *overloaded = true;
+                }
+                if (shed && wait) {
+                    *shed = true;
+                }
+                return SessionPtr();
+            }
+            if (!released.timed_wait(lock, queueDeadline) && !isAdmitted(lane)) {
+                logDebug("ClamAV Server %s is overloaded, %u scans are in progress", server.c_str(), 
+                        (unsigned int) countLoad());
+                if (overloaded) {
+                    *overloaded = true;
+                }
+                return SessionPtr();
+            }
+            continue;
+        }
+
+        /* the least loaded healthy session of the lane with free pipeline slot, or an idle session of another lane */
+        Entry *best = NULL;
+        Entry *idle = NULL;
+        for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+            if (i->session->isBroken() || (i->leases >= config.depth)) {
+                continue;
+            }
+            if (!scan || (i->lane == lane)) {
+                if (!best || (i->leases < best->leases)) {
+                    best = &(*i);
+                }
+            }
+            else if ((i->leases == 0) && !idle) {
+                idle = &(*i);
+            }
+        }
+        if (idle && (!best || (best->leases > 0))) {
+            best = idle; // borrowed session moves to this lane, scans of its lane do not queue behind this one
+        }
+
+        /* open another connection rather than queueing behind a busy one */
+        if (canGrow && (!best || best->leases > 0) && (entries.size() + opening < config.maxSize)) {
+            opening++;
+            if (scan) {
+                laneLoad[lane]++;
+            }
+            lock.unlock();
+            SessionPtr session = grow(true, lane);
+            if (session) {
+                return session;
+            }
+            lock.lock();
+            if (scan) {
+                laneLoad[lane]--;
+            }
+            if (!best) {
+                return SessionPtr(); // ClamAV Server is not reachable
+            }
+            canGrow = false;
+            continue; // list of entries might have changed meanwhile
+        }
+
+        if (best) {
+            if (scan) {
+                best->lane = lane;
+                laneLoad[lane]++;
+            }
+            best->leases++;
+            best->lastUsed = monotonicMs();
+            return best->session;
+        }
+
+        if (!wait) {
+            return SessionPtr();
+        }
+
+        if (!released.timed_wait(lock, deadline)) {
+            logWarning("No connection to ClamAV Server has been released in %d seconds", config.timeout);
+            (void) breaker.failure(monotonicMs(), false);
+            return SessionPtr();
+        }
+    }
+    return SessionPtr();
+}
+
+void ClamPlugin::Pool::release(SessionPtr &session, const unsigned long long *size)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (size) {
+        laneLoad[getLane(*size)]--;
+    }
+
+    for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+        if (i->session == session) {
+            i->leases--;
+            i->lastUsed = monotonicMs();
+            break;
+        }
+    }
+    session.reset();
+    released.notify_all(); // both scans queued at concurrency limit and scans waiting for a free session
+}
+
+void ClamPlugin::Pool::trim()
+{
+    Sessions dropped;
+    {
+        MutexType::scoped_lock lock(mutex);
+        long long now = monotonicMs();
+        size_t count[LaneCount] = {0};
+        for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+            count[i->lane]++;
+        }
+
+        for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ) {
+            /* every lane keeps its last connection */
+            bool idle = (i->leases == 0) && (entries.size() > config.minSize) && (count[i->lane] > 1) &&
+                    (now - i->lastUsed > (long long) config.idleTime * 1000);
+            if ((i->session->isBroken() && (i->leases == 0)) || idle) {
+                count[i->lane]--;
+                dropped.push_back(i->session);
+                i = entries.erase(i);
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+
+    /* sessions are closed outside of the lock, END and reactor removal may take a while */
+    for (Sessions::iterator i = dropped.begin(); i != dropped.end(); ++i) {
+        (*i)->close();
+    }
+    fill();
+}
+
+long long ClamPlugin::Pool::getUploadTime(unsigned long long size)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    double budget = UPLOAD_BASE_TIME + DEADLINE_SLACK * (double) size / uploadRate;
+    return (long long) std::min(budget, config.scanTimeout * 1000.0);
+}
+
+long long ClamPlugin::Pool::getVerdictTime(unsigned long long size)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    double budget = VERDICT_BASE_TIME + DEADLINE_SLACK * (double) size / scanRate;
+    return (long long) std::min(budget, config.scanTimeout * 1000.0);
+}
+
+void ClamPlugin::Pool::measure(unsigned long long size, long long uploadTime, long long verdictTime)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    /* verdict much slower than throughput predicts means the scan has waited in clamd queue */
+    if (verdictTime > CONGESTION_BASE_TIME + (long long) (2.0 * (double) size / scanRate)) {
+        if (limiter.shrink(monotonicMs())) {
+            logDebug("ClamAV Server %s is congested, at most %u scans are sent to it", server.c_str(), 
+                    (unsigned int) limiter.getLimit());
+        }
+    }
+    else {
+        limiter.grow(countLoad());
+    }
+
+    if (size < THROUGHPUT_SAMPLE_SIZE) {
+        return;
+    }
+
+    /* exponentially weighted moving average */
+    if (uploadTime >= 0) {
+        uploadRate = std::max(MIN_THROUGHPUT, 0.8 * uploadRate + 0.2 * (double) size / std::max(uploadTime, 1LL));
+    }
+    scanRate = std::max(MIN_THROUGHPUT, 0.8 * scanRate + 0.2 * (double) size / std::max(verdictTime, 1LL));
+}
+
+void ClamPlugin::Pool::congested()
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (limiter.shrink(monotonicMs())) {
+        logDebug("ClamAV Server %s is congested, at most %u scans are sent to it", server.c_str(), 
+                (unsigned int) limiter.getLimit());
+    }
+}
+
+bool ClamPlugin::Pool::exceedsStreamLimit(unsigned long long size)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    return (streamLimit > 0) && (size > streamLimit);
+}
+
+void ClamPlugin::Pool::limitStream(unsigned long long size)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if ((size > 1) && ((streamLimit == 0) || (size - 1 < streamLimit))) {
+        streamLimit = size - 1;
+        logDebug("ClamAV Server %s refuses to scan files larger than %u kB", server.c_str(), 
+                (unsigned int) (streamLimit / 1024));
+    }
+}
+
+void ClamPlugin::Pool::checkStats()
+{
+    SyncStream stream(config.connectTimeout);
+    std::string reply;
+    std::string address = server;
+    try {
+        if (!stream.connect(address) || 
+                !stream.query("STATS", reply, monotonicMs() + (long long) config.connectTimeout * 1000)) {
+            logDebug("Cannot read STATS of ClamAV Server %s", server.c_str());
+            return;
+        }
+    }
     catch (std::exception &e) {
-        std::string msg = "Cannot connect to ClamAV Server, error: " + std::string(e.what());
-        strncpys(errorMessage, msg.c_str(), MAX_STRING);
-        logError("%s", msg.c_str());
-        this->state = Failed;
-        return 0;
+        logDebug("Cannot read STATS of ClamAV Server %s, error: %s", server.c_str(), e.what());
+        return;
     }
 
-    if (!connection->startSession()) {
-        logError("Cannot initiate session at the ClamAV Server");
-        this->state = Failed;
+    /* e.g. "THREADS: live 12  idle 0 max 12 idle-timeout 30" and "QUEUE: 3 items" */
+    int live = -1;
+    int idle = -1;
+    int max = -1;
+    int queued = -1;
+    std::istringstream lines(reply);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (0 == line.compare(0, 8, "THREADS:")) {
+            (void) sscanf(line.c_str(), "THREADS: live %d idle %d max %d", &live, &idle, &max);
+        }
+        else if (0 == line.compare(0, 6, "QUEUE:")) {
+            (void) sscanf(line.c_str(), "QUEUE: %d", &queued);
+        }
+    }
+    if ((queued > 0) || ((max > 0) && (live >= max) && (idle == 0))) {
+        logDebug("ClamAV Server %s has all %d threads busy and %d requests queued", server.c_str(), max, queued);
+        congested();
+    }
+}
+
+void ClamPlugin::Pool::report(bool succeeded)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    if (succeeded) {
+        if (breaker.success()) {
+            logWarning("ClamAV Server %s is available again", server.c_str());
+        }
+    }
+    else if (breaker.failure(monotonicMs(), false)) {
+        logWarning("Scanning by ClamAV Server %s keeps failing, it will not be used for %d seconds", server.c_str(), 
+                config.breakerOpenTime);
+    }
+}
+
+void ClamPlugin::Pool::probe()
+{
+    {
+        MutexType::scoped_lock lock(mutex);
+        if (closed || !breaker.isProbeDue(monotonicMs())) {
+            return;
+        }
+        (void) breaker.allow(monotonicMs()); // half-open, scans are refused until the probe finishes
+    }
+
+    SessionPtr session = acquire();
+    if (!session) {
+        return; // failure has been recorded already
+    }
+    std::string error;
+    bool result = session->sendPingPong(error);
+    release(session);
+    report(result);
+}
+
+long long ClamPlugin::Pool::schedule(long long now, long long pingAfter, Sessions &due)
+{
+    MutexType::scoped_lock lock(mutex);
+
+    long long next = breaker.getProbeTime();
+    for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+        if (i->session->isBroken()) {
+            continue;
+        }
+        if ((i->leases == 0) && (entries.size() > config.minSize)) {
+            next = earliest(next, i->lastUsed + (long long) config.idleTime * 1000);
+        }
+
+        long long idleSince = i->session->getIdleSince();
+        if (idleSince < 0) {
+            continue; // replies of pending requests keep the connection alive
+        }
+        if (idleSince + pingAfter <= now) {
+            due.push_back(i->session);
+        }
+        else {
+            next = earliest(next, idleSince + pingAfter);
+        }
+    }
+    return next;
+}
+
+const std::string &ClamPlugin::Pool::getServer() const
+{
+    return server;
+}
+
+size_t ClamPlugin::Pool::getLoad()
+{
+    MutexType::scoped_lock lock(mutex);
+
+    return countLoad();
+}
+
+bool ClamPlugin::Pool::isAvailable()
+{
+    MutexType::scoped_lock lock(mutex);
+
+    return !closed && breaker.isAllowed(monotonicMs());
+}
+
+void ClamPlugin::Pool::close()
+{
+    Sessions all;
+    {
+        MutexType::scoped_lock lock(mutex);
+        closed = true;
+        for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+            all.push_back(i->session);
+        }
+        entries.clear();
+        released.notify_all();
+    }
+
+    for (Sessions::iterator i = all.begin(); i != all.end(); ++i) {
+        (*i)->close();
+    }
+}
+
+ClamPlugin::ClamPlugin()
+{
+    this->port = DEFAULT_PORT;
+    this->resolveInterval = DEFAULT_RESOLVE_INTERVAL;
+    this->affinity = false;
+    this->poolConfig.timeout = INIT_TIMEOUT;
+    this->poolConfig.minSize = DEFAULT_MIN_CONNECTIONS;
+    this->poolConfig.maxSize = DEFAULT_MAX_CONNECTIONS;
+    this->poolConfig.depth = DEFAULT_PIPELINE_DEPTH;
+    this->poolConfig.idleTime = DEFAULT_POOL_IDLE_TIME;
+    this->poolConfig.breakerThreshold = DEFAULT_BREAKER_THRESHOLD;
+    this->poolConfig.breakerOpenTime = DEFAULT_BREAKER_OPEN_TIME;
+    this->poolConfig.connectTimeout = DEFAULT_CONNECT_TIMEOUT;
+    this->poolConfig.scanTimeout = DEFAULT_SCAN_TIMEOUT;
+    this->scanRetries = DEFAULT_SCAN_RETRIES;
+    this->balancerCounter = 0;
+    this->closing = false;
+    this->state = Closed;
+    this->runningThreads = 0;
+    this->pingThreadHandle = NULL;
+    this->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    this->hedgePercentile = DEFAULT_HEDGE_PERCENTILE;
+    this->poolConfig.queueTimeout = DEFAULT_QUEUE_TIMEOUT;
+    this->poolConfig.shed = false;
+    this->poolConfig.shedSize = (unsigned long long) DEFAULT_SHED_SIZE * 1024;
+    this->poolConfig.mediumSize = (unsigned long long) DEFAULT_MEDIUM_FILE_SIZE * 1024;
+    this->poolConfig.largeSize = (unsigned long long) DEFAULT_LARGE_FILE_SIZE * 1024;
+    this->poolConfig.chunkSize = (size_t) DEFAULT_STREAM_CHUNK_SIZE * 1024;
+    this->poolConfig.streamLimit = 0;
+    this->statsInterval = DEFAULT_STATS_INTERVAL;
+    this->poolConfig.reactor = &this->reactor;
+}
+
+ClamPlugin::~ClamPlugin()
+{
+    this->closing = true;
+    {
+        MutexType::scoped_lock lock(this->scheduleMutex);
+        this->scheduleChanged.notify_all();
+    }
+
+    if (NULL != this->pingThreadHandle) {
+        this->pingThreadHandle->join();
+        delete this->pingThreadHandle;
+        this->pingThreadHandle = NULL;
+    }
+
+    for (std::vector<ThreadContext *>::iterator i = this->freeContexts.begin(); i != this->freeContexts.end(); ++i) {
+        delete *i;
+    }
+}
+
+int ClamPlugin::ThreadInit(void **context)
+{
+    logDebug("Initializing context");
+    if (this->getBackends().empty() || (context == NULL)) {
+        logDebug("Internal context error");
         return 0;
     }
-    
-    this->startConnectionRefresh(connection);
-    
-    *context = new SyncStreamPtr(connection);
+
+    /* connections are shared by all threads, context only keeps the request waiting for reply */
+    ThreadContext *threadContext = NULL;
+    {
+        MutexType::scoped_lock lock(this->contextsMutex);
+        if (!this->freeContexts.empty()) {
+            threadContext = this->freeContexts.back();
+            this->freeContexts.pop_back();
+        }
+    }
+    *context = threadContext ? threadContext : new ThreadContext();
     logDebug("Context initialized");    
     return 1;
 }
 
 int ClamPlugin::ThreadClose(void **context)
 {
-    int result = 0;
-
     logDebug("De-initializing context");
-    if (context) {
-        SyncStreamPtr * connection((SyncStreamPtr *) * context);
+    if (context && *context) {
+        ThreadContext *threadContext = (ThreadContext *) *context;
+        *context = NULL;
 
-        this->dropConnectionRefresh(*connection);
+        threadContext->release();
+        {
+            MutexType::scoped_lock lock(this->contextsMutex);
+            if (this->freeContexts.size() < MAX_FREE_CONTEXTS) {
+                this->freeContexts.push_back(threadContext);
+                return 1;
+            }
+        }
+        delete threadContext;
+        return 1;
+    }
+    return 0;
+}
 
-        if (!connection->get()->endSession()) {
-            logWarning("Cannot destroy session at the ClamAV Server");
-            result = 0;
-        } 
-        else {
-            result = 1;
+int ClamPlugin::Init()
+{
+    if (this->state != Failed && this->state != Closed) {
+        strncpys(errorMessage, "The Clam AntiVirus plugin has already been initialized.", MAX_STRING);
+        logError("The Clam AntiVirus plugin has already been initialized.");
+        this->state = Failed;
+        return 0;
+    }
+    this->state = Initializing;
+
+    string address;
+    string scanMode;
+    string verdictFile;
+    int verdictFileSize = DEFAULT_VERDICT_FILE_SIZE;
+    string journalFile;
+    int journalFileSize = DEFAULT_JOURNAL_FILE_SIZE;
+    int minConnections = DEFAULT_MIN_CONNECTIONS;
+    int maxConnections = DEFAULT_MAX_CONNECTIONS;
+    int pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    int breakerThreshold = DEFAULT_BREAKER_THRESHOLD;
+    int breakerOpenTime = DEFAULT_BREAKER_OPEN_TIME;
+    int connectTimeout = DEFAULT_CONNECT_TIMEOUT;
+    int scanTimeout = DEFAULT_SCAN_TIMEOUT;
+    int hedgeBudget = DEFAULT_HEDGE_BUDGET;
+    int queueTimeout = DEFAULT_QUEUE_TIMEOUT;
+    int shedSize = DEFAULT_SHED_SIZE;
+    int mediumFileSize = DEFAULT_MEDIUM_FILE_SIZE;
+    int largeFileSize = DEFAULT_LARGE_FILE_SIZE;
+    int streamChunkSize = DEFAULT_STREAM_CHUNK_SIZE;
+    int streamMaxLength = 0;
+    string overloadPolicy;
+    this->statsInterval = DEFAULT_STATS_INTERVAL;
+    this->hedgePercentile = DEFAULT_HEDGE_PERCENTILE;
+    this->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+
+    this->port = DEFAULT_PORT;
+    this->localSocket.clear();
+    this->resolveInterval = DEFAULT_RESOLVE_INTERVAL;
+    this->affinity = false;
+    this->poolConfig.idleTime = DEFAULT_POOL_IDLE_TIME;
+    this->scanRetries = DEFAULT_SCAN_RETRIES;
+
+    logDebug("Initializing Clam AntiVirus plugin...");
+
+    avir_plugin_config *cfg = getPluginConfig();
+
+    for (unsigned int i = 0; cfg[i].name[0]; i++) {
+        if (stricmp("Address", cfg[i].name) == 0) {
+            address = cfg[i].value;
+            continue;
+        }
+        if (stricmp("Port", cfg[i].name) == 0) {
+            this->port = cfg[i].value;
+            continue;
+        }
+        if (stricmp("LocalSocket", cfg[i].name) == 0) {
+            this->localSocket = cfg[i].value;
+            continue;
+        }
+        if (stricmp("ResolveInterval", cfg[i].name) == 0) {
+            this->resolveInterval = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("ScanRetries", cfg[i].name) == 0) {
+            this->scanRetries = std::max(0, atoi(cfg[i].value));
+            continue;
+        }
+        if (stricmp("Affinity", cfg[i].name) == 0) {
+            this->affinity = (atoi(cfg[i].value) != 0);
+            continue;
+        }
+        if (stricmp("MinConnections", cfg[i].name) == 0) {
+            minConnections = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("MaxConnections", cfg[i].name) == 0) {
+            maxConnections = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("PipelineDepth", cfg[i].name) == 0) {
+            pipelineDepth = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("PoolIdleTime", cfg[i].name) == 0) {
+            this->poolConfig.idleTime = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("BreakerThreshold", cfg[i].name) == 0) {
+            breakerThreshold = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("BreakerOpenTime", cfg[i].name) == 0) {
+            breakerOpenTime = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("ConnectTimeout", cfg[i].name) == 0) {
+            connectTimeout = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("ScanTimeout", cfg[i].name) == 0) {
+            scanTimeout = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("QueueTimeout", cfg[i].name) == 0) {
+            queueTimeout = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("OverloadPolicy", cfg[i].name) == 0) {
+            overloadPolicy = cfg[i].value;
+            continue;
+        }
+        if (stricmp("ShedSize", cfg[i].name) == 0) {
+            shedSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("MediumFileSize", cfg[i].name) == 0) {
+            mediumFileSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("LargeFileSize", cfg[i].name) == 0) {
+            largeFileSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("StreamChunkSize", cfg[i].name) == 0) {
+            streamChunkSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("StreamMaxLength", cfg[i].name) == 0) {
+            streamMaxLength = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("StatsInterval", cfg[i].name) == 0) {
+            this->statsInterval = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("HedgeBudget", cfg[i].name) == 0) {
+            hedgeBudget = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("HedgePercentile", cfg[i].name) == 0) {
+            this->hedgePercentile = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("IdleTimeout", cfg[i].name) == 0) {
+            this->idleTimeout = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("VerdictCacheFile", cfg[i].name) == 0) {
+            verdictFile = cfg[i].value;
+            continue;
+        }
+        if (stricmp("VerdictCacheFileSize", cfg[i].name) == 0) {
+            verdictFileSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("ScanJournalFile", cfg[i].name) == 0) {
+            journalFile = cfg[i].value;
+            continue;
+        }
+        if (stricmp("ScanJournalFileSize", cfg[i].name) == 0) {
+            journalFileSize = atoi(cfg[i].value);
+            continue;
+        }
+        if (stricmp("ScanMode", cfg[i].name) == 0) {
+            scanMode = cfg[i].value;
+            continue;
+        }
+        if (stricmp("PathPrefix", cfg[i].name) == 0) {
+            this->pathPrefix = cfg[i].value;
+            continue;
+        }
+        if (stricmp("ServerPathPrefix", cfg[i].name) == 0) {
+            this->serverPathPrefix = cfg[i].value;
+            continue;
+        }
+        if (stricmp("StartupTimeout", cfg[i].name) == 0) {
+            string tm = cfg[i].value;
+            timeout = atoi(tm.c_str());
+            continue;
         }
+    }
 
-        delete connection;
-        *context = NULL;
+    freePluginConfig(cfg);
+
+    if (timeout < INIT_TIMEOUT) {
+        timeout = INIT_TIMEOUT;
+    }
+
+    if (timeout > MAX_TIMEOUT) {
+        timeout = MAX_TIMEOUT;
+    }
+
+    logDebug("Startup timeout is set to %d", timeout);
+
+    if (maxConnections < 1) {
+        maxConnections = 1;
+    }
+
+    if (maxConnections > MAX_CONNECTIONS) {
+        maxConnections = MAX_CONNECTIONS;
+    }
+
+    if (minConnections < LaneCount) {
+        minConnections = LaneCount; // one connection per lane
+    }
+
+    if (minConnections > maxConnections) {
+        minConnections = maxConnections;
+    }
+
+    if (pipelineDepth < 1) {
+        pipelineDepth = 1;
+    }
+
+    if (breakerThreshold < 1) {
+        breakerThreshold = 1;
+    }
+
+    if (breakerOpenTime < 1) {
+        breakerOpenTime = 1;
+    }
+
+    if ((connectTimeout < 1) || (connectTimeout > timeout)) {
+        connectTimeout = timeout;
+    }
+
+    if (scanTimeout < 1) {
+        scanTimeout = DEFAULT_SCAN_TIMEOUT;
+    }
+
+    if (this->idleTimeout < 1) {
+        this->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    }
+
+    if (queueTimeout < 1) {
+        queueTimeout = DEFAULT_QUEUE_TIMEOUT;
+    }
+
+    if (shedSize < 0) {
+        shedSize = DEFAULT_SHED_SIZE;
+    }
+
+    if (mediumFileSize < 1) {
+        mediumFileSize = DEFAULT_MEDIUM_FILE_SIZE;
+    }
+
+    if (largeFileSize < mediumFileSize) {
+        largeFileSize = (DEFAULT_LARGE_FILE_SIZE > mediumFileSize) ? DEFAULT_LARGE_FILE_SIZE : mediumFileSize;
+    }
+
+    if ((streamChunkSize < 1) || (streamChunkSize > MAX_STREAM_CHUNK_SIZE)) {
+        streamChunkSize = DEFAULT_STREAM_CHUNK_SIZE;
+    }
+
+    if (streamMaxLength < 0) {
+        streamMaxLength = 0;
+    }
+
+    if (this->statsInterval < 0) {
+        this->statsInterval = DEFAULT_STATS_INTERVAL;
     }
-    return result;
-}
 
-int ClamPlugin::Init()
-{
-    if (this->state != Failed && this->state != Closed) {
-        strncpys(errorMessage, "The Clam AntiVirus plugin has already been initialized.", MAX_STRING);
-        logError("The Clam AntiVirus plugin has already been initialized.");
-        this->state = Failed;
-        return 0;
+    if ((hedgeBudget < 0) || (hedgeBudget > 100)) {
+        hedgeBudget = DEFAULT_HEDGE_BUDGET;
     }
-    this->state = Initializing;
 
-    string address;
-    string port = DEFAULT_PORT;
+    if ((this->hedgePercentile < 50) || (this->hedgePercentile > 99)) {
+        this->hedgePercentile = DEFAULT_HEDGE_PERCENTILE;
+    }
 
-    logDebug("Initializing Clam AntiVirus plugin...");
+    this->poolConfig.timeout = timeout;
+    this->poolConfig.minSize = minConnections;
+    this->poolConfig.maxSize = maxConnections;
+    this->poolConfig.depth = pipelineDepth;
+    this->poolConfig.breakerThreshold = breakerThreshold;
+    this->poolConfig.breakerOpenTime = breakerOpenTime;
+    this->poolConfig.connectTimeout = connectTimeout;
+    this->poolConfig.scanTimeout = scanTimeout;
+    this->poolConfig.queueTimeout = queueTimeout;
+    this->poolConfig.shed = false;
+    this->poolConfig.shedSize = (unsigned long long) shedSize * 1024;
+    this->poolConfig.mediumSize = (unsigned long long) mediumFileSize * 1024;
+    this->poolConfig.largeSize = (unsigned long long) largeFileSize * 1024;
+    this->poolConfig.chunkSize = (size_t) streamChunkSize * 1024;
+    this->poolConfig.streamLimit = (unsigned long long) streamMaxLength * 1024 * 1024;
+    if (stricmp("Shed", overloadPolicy.c_str()) == 0) {
+        this->poolConfig.shed = true;
+        logDebug("Files larger than %d kB are not scanned by overloaded ClamAV Server", shedSize);
+    }
+    else if (!overloadPolicy.empty() && (stricmp("Queue", overloadPolicy.c_str()) != 0)) {
+        logWarning("Unknown overload policy '%s', scans will be queued", overloadPolicy.c_str());
+    }
+    logDebug("Scans wait at most %d seconds when ClamAV Server is overloaded", queueTimeout);
+    logDebug("Files from %d kB and from %d kB are scanned in medium and large lanes", mediumFileSize, largeFileSize);
+    if (streamMaxLength > 0) {
+        logDebug("Files are streamed in %d kB chunks, files larger than %d MB are not scanned", streamChunkSize, 
+                streamMaxLength);
+    }
+    else {
+        logDebug("Files are streamed in %d kB chunks, StreamMaxLength is learned from ClamAV Server", streamChunkSize);
+    }
+    logDebug("Connections per server: %d-%d, pipeline depth %d, idle time %d", minConnections, maxConnections, pipelineDepth, 
+            this->poolConfig.idleTime);
+    logDebug("Circuit breaker opens after %d failed scans for %d seconds", breakerThreshold, breakerOpenTime);
+    logDebug("Connect timeout is set to %d, scan deadlines are at most %d", connectTimeout, scanTimeout);
 
-    avir_plugin_config *cfg = getPluginConfig();
+    /* concurrent scans of the same content wait for the first one until it has a session, then until its deadline */
+    verdictCacheSetWaitTimeout(connectTimeout + queueTimeout);
 
-    for (unsigned int i = 0; cfg[i].name[0]; i++) {
-        if (stricmp("Address", cfg[i].name) == 0) {
-            address = cfg[i].value;
-            continue;
-        }
-        if (stricmp("Port", cfg[i].name) == 0) {
-            port = cfg[i].value;
-            continue;
-        }
-        if (stricmp("StartupTimeout", cfg[i].name) == 0) {
-            string tm = cfg[i].value;
-            timeout = atoi(tm.c_str());
-            continue;
-        }
+    this->hedgeBudget.setPercent(hedgeBudget);
+    if (hedgeBudget > 0) {
+        logDebug("Scans later than %d%% of recent scans are hedged, at most %d%% of scans", this->hedgePercentile, hedgeBudget);
     }
 
-    freePluginConfig(cfg);
+    if (verdictFileSize > MAX_VERDICT_FILE_SIZE) {
+        logWarning("Verdict cache file is limited to %d MB", MAX_VERDICT_FILE_SIZE);
+        verdictFileSize = MAX_VERDICT_FILE_SIZE;
+    }
+    if (verdictFileSize < 1) {
+        verdictFileSize = DEFAULT_VERDICT_FILE_SIZE;
+    }
 
-    if (timeout < INIT_TIMEOUT) {
-        timeout = INIT_TIMEOUT;
+    /* verdicts of previous runs are usable once the engine version is known */
+    if (!verdictCacheOpenFile(verdictFile.c_str(), (unsigned long) verdictFileSize * 1024 * 1024)) {
+        logWarning("Verdict cache file %s cannot be used, verdicts will not survive restart", verdictFile.c_str());
     }
 
-    if (timeout > MAX_TIMEOUT) {
-        timeout = MAX_TIMEOUT;
+    if (journalFileSize > MAX_JOURNAL_FILE_SIZE) {
+        logWarning("Scan journal file is limited to %d MB", MAX_JOURNAL_FILE_SIZE);
+        journalFileSize = MAX_JOURNAL_FILE_SIZE;
+    }
+    if (journalFileSize < 1) {
+        journalFileSize = DEFAULT_JOURNAL_FILE_SIZE;
+    }
+    if (!scanJournalOpen(journalFile.c_str(), (unsigned long) journalFileSize * 1024 * 1024)) {
+        logWarning("Scan journal file %s cannot be used, scans will not be recorded", journalFile.c_str());
     }
 
-    logDebug("Startup timeout is set to %d", timeout);
+    if (scanMode.empty() || (stricmp("Stream", scanMode.c_str()) == 0)) {
+        this->scanCommand.clear();
+    }
+    else if ((stricmp("Scan", scanMode.c_str()) == 0) || (stricmp("ContScan", scanMode.c_str()) == 0)) {
+        this->scanCommand = (stricmp("Scan", scanMode.c_str()) == 0) ? "SCAN" : "CONTSCAN";
+        logDebug("Files are scanned by path using %s, '%s' is mapped to '%s'", this->scanCommand.c_str(), 
+                this->pathPrefix.c_str(), this->serverPathPrefix.c_str());
+    }
+    else {
+        logWarning("Unknown scan mode '%s', files will be streamed", scanMode.c_str());
+        this->scanCommand.clear();
+    }
 
-    try {
-        boost::asio::io_service io_service;
-        boost::asio::ip::tcp::resolver resolver(io_service);
-        boost::asio::ip::tcp::resolver::query query(address.c_str(), "");
-        boost::asio::ip::tcp::resolver::iterator iter = resolver.resolve(query);
-        boost::asio::ip::tcp::resolver::iterator end;
-
-        if (iter != end) {
-            boost::asio::ip::address addr = iter->endpoint().address();
-            stringstream hostPort;
-            hostPort << addr.to_string() << ":" << port;
-            this->server = hostPort.str();
-            logDebug("ClamAV Server IP address: %s", this->server.c_str());
-        } 
-        else {
-            std::string msg = "Cannot resolve host (" + address + ").";
+    std::vector<std::string> servers;
+    if (!this->localSocket.empty()) {
+        if (this->localSocket[0] != '/') {
+            std::string msg = "Local socket path must be absolute (" + this->localSocket + ").";
             strncpys(errorMessage, msg.c_str(), MAX_STRING);
             logError("%s", msg.c_str());
             this->state = Failed;
             return 0;
         }
+        servers.push_back(this->localSocket);
+        logDebug("ClamAV Server local socket: %s", this->localSocket.c_str());
     }
-    catch (std::exception &e) {
-        std::string msg = "Cannot resolve host (" + address + "). Error: " + std::string(e.what());
-        strncpys(errorMessage, msg.c_str(), MAX_STRING);
-        logError("%s", msg.c_str());
-        this->state = Failed;
-        return 0;
-    }
+    else {
+        this->addresses.clear();
+        splitAddresses(address, this->addresses);
 
-    SyncStreamPtr connection(new SyncStream(timeout));
-    try {
-        if (!connection->connect(this->server)) {
-            strncpys(errorMessage, "Cannot connect to ClamAV Server.", MAX_STRING);
-            logError("Cannot connect to ClamAV Server on %s", this->server.c_str());
+        std::string msg;
+        if (!this->resolveServers(servers, msg)) {
+            strncpys(errorMessage, msg.c_str(), MAX_STRING);
+            logError("%s", msg.c_str());
             this->state = Failed;
             return 0;
         }
     }
-    catch (std::exception &e) {
-        std::string msg = "Cannot connect to ClamAV Server, error: " + std::string(e.what());
-        strncpys(errorMessage, msg.c_str(), MAX_STRING);
-        logError("%s", msg.c_str());
+
+    if (!this->reactor.start()) {
+        strncpys(errorMessage, "Unable to run thread for ClamAV Server connections.", MAX_STRING);
+        logError("Unable to run thread for ClamAV Server connections.");
         this->state = Failed;
         return 0;
     }
-
-    bool result = connection->startSession();
-    if (!result) {
-        logWarning("Cannot initiate session to the ClamAV Server");
-    } 
-    else {
-        logDebug("Session initialized.");
+    this->updateBackends(servers);
+
+    /* check protocol with the first reachable server */
+    Backends current = this->getBackends();
+    SessionPtr session;
+    PoolPtr pool;
+    for (Backends::iterator i = current.begin(); !session && (i != current.end()); ++i) {
+        pool = *i;
+        session = pool->lease();
+    }
+    if (!session) {
+        strncpys(errorMessage, "Cannot connect to ClamAV Server.", MAX_STRING);
+        this->updateBackends(std::vector<std::string>());
+        this->state = Failed;
+        return 0;
     }
+    logDebug("Session initialized.");
 
     string error;
-    if (!connection->sendPingPong(error)) {
+    bool result = session->sendPingPong(error);
+    if (!result) {
         strncpys(errorMessage, error.c_str(), MAX_STRING);
-        this->state = Failed;
-        return 0;
     }
     
     string answer;
-    if (!connection->getVersion(answer)) {
+    if (result && !session->getVersion(answer)) {
         strncpys(errorMessage, "Only ClamAV Server 0.95 and newer is supported.", MAX_STRING);
         logError("Only ClamAV Server 0.95 and newer is supported.");
+        result = false;
+    }
+    pool->release(session);
+
+    if (!result) {
+        this->updateBackends(std::vector<std::string>());
         this->state = Failed;
         return 0;
     }
     logDebug("Version: %s", answer.c_str());
 
-    result = connection->endSession();
-    if (!result) {
-        logWarning("Cannot destroy session at the ClamAV Server");
-    } 
-    else {
-        logDebug("Session finished.");
+    /* pre-warm connections, so that first scans of new threads do not wait for connect */
+    for (Backends::iterator i = current.begin(); i != current.end(); ++i) {
+        size_t count = (*i)->fill(); // not inside logDebug, which may be compiled out
+        logDebug("%u connections to ClamAV Server %s are open", (unsigned int) count, (*i)->getServer().c_str());
     }
+    this->engineVersions.clear();
+    this->checkVersions();
 
     logDebug("The engine has been initialized");
     this->state = Running;
@@ -446,6 +2912,10 @@ int ClamPlugin::Close()
     logDebug("The Clam AntiVirus plugin is closing...");
     this->closing = true;
     this->state = Closing;
+    {
+        MutexType::scoped_lock lock(this->scheduleMutex);
+        this->scheduleChanged.notify_all();
+    }
 
     int count = atomicGet(&this->runningThreads);    
     while (count > 0) {
@@ -460,6 +2930,10 @@ int ClamPlugin::Close()
         this->pingThreadHandle = NULL;
     }
 
+    this->updateBackends(std::vector<std::string>());
+    this->reactor.stop();
+
+    this->closing = false;
     this->state = Closed;
     return 1;
 }
@@ -473,36 +2947,47 @@ int ClamPlugin::TestFile(void *context, const char *filename, const char *realna
         return AVCHK_ERROR;
     }
 
-    /* check whether file exists */
-    try {
-        if (!boost::filesystem::exists(filename)) {
-            std::string response = std::string(filename) + " does not exist.";
-            strncpys(vir_info, response.c_str(), vi_size);
-            logDebug("Scanned file %s", vir_info);
+    /* one lookup of the path, the descriptor opened by the wrapper (or here) is used by the whole scan */
+    unsigned long long fileSize = 0;
+    int fd = getScannedFile(&fileSize);
+    bool ownDescriptor = (fd == -1);
+    if (ownDescriptor) {
+        /* O_NONBLOCK keeps open() of a FIFO from blocking, it is refused below */
+        struct stat sb;
+        fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+        if ((fd == -1) || (-1 == fstat(fd, &sb))) {
+            int error = errno;
+            if (fd != -1) {
+                close(fd);
+            }
+            if (error == ENOENT) {
+                std::string response = std::string(filename) + " does not exist.";
+                strncpys(vir_info, response.c_str(), vi_size);
+                logDebug("Scanned file %s", vir_info);
+                return AVCHK_FAILED;
+            }
+            std::string msg = "Cannot check file: " + std::string(filename) + ", error: " + strerror(error);
+            strncpys(vir_info, msg.c_str(), vi_size);
+            logDebug("%s", vir_info);
             return AVCHK_FAILED;
         }
-    } 
-    catch (boost::filesystem::filesystem_error &e) {
-        std::string msg = "Cannot check file: " + std::string(filename) + ", error: " + std::string(e.what());
-        strncpys(vir_info, msg.c_str(), vi_size);
-        logDebug("%s", vir_info);
-        return AVCHK_FAILED;
+        if (!S_ISREG(sb.st_mode)) {
+            close(fd);
+            std::string msg = "Cannot check file size: " + std::string(filename) + ", error: Not a regular file";
+            strncpys(vir_info, msg.c_str(), vi_size);
+            logDebug("%s", vir_info);
+            return AVCHK_FAILED;
+        }
+        fileSize = (unsigned long long) sb.st_size;
     }
+    DescriptorGuard guard(ownDescriptor ? fd : -1);
 
     /* check whether file is non empty, empty file doesnt need to be checked and are AVCHK_OK by default*/
-    try {
-        if (0 == boost::filesystem::file_size(filename)) {
-            std::string response = std::string(filename) + " is empty.";
-            strncpys(vir_info, response.c_str(), vi_size);
-            logDebug("Scanned file %s", vir_info);
-            return AVCHK_OK;
-        }
-    } 
-    catch (boost::filesystem::filesystem_error &e) {
-        std::string msg = "Cannot check file size: " + std::string(filename) + ", error: " + std::string(e.what());
-        strncpys(vir_info, msg.c_str(), vi_size);
-        logDebug("%s", vir_info);
-        return AVCHK_FAILED;
+    if (0 == fileSize) {
+        std::string response = std::string(filename) + " is empty.";
+        strncpys(vir_info, response.c_str(), vi_size);
+        logDebug("Scanned file %s", vir_info);
+        return AVCHK_OK;
     }
 
     /* check whether engine has been initialized */
@@ -526,207 +3011,595 @@ int ClamPlugin::TestFile(void *context, const char *filename, const char *realna
     }
 
     /* default results */
-    std::string errmsg = "Internal error";
+    const char *errmsg = "Internal error";
     int scanningResult = AVCHK_ERROR; // kill plugin and make new initialization (recovery)
-    bool result;
-    SyncStreamPtr connection(*(SyncStreamPtr *) context);
-
-    MutexType::scoped_lock lock(*connection->mutex.get());
+    ThreadContext &threadContext = *(ThreadContext *) context;
+    string &answer = threadContext.answer;
+
+    unsigned long long key = 0;
+    bool useKey = this->affinity && affinityKey(fd, fileSize, threadContext.sample, key);
+
+    /* broken connections (idle timeout, clamd restart) are replaced and the scan is replayed */
+    ScanOutcome outcome = this->scanFile(threadContext, filename, fd, fileSize, useKey ? &key : NULL, answer);
+    for (int retry = 0; (outcome != ScanAnswered) && (outcome != ScanCircuitOpen) && (outcome != ScanTimedOut) && 
+            (outcome != ScanOverloaded) && (outcome != ScanShed) && (outcome != ScanTooLarge) && 
+            (outcome != ScanFileError) && 
+            (retry < this->scanRetries) && !this->closing; retry++) {
+        logDebug("Scanning of %s has been interrupted (%s), retrying...", filename, answer.c_str());
+        if (retry > 0) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(RETRY_DELAY * retry));
+        }
+        outcome = this->scanFile(threadContext, filename, fd, fileSize, useKey ? &key : NULL, answer);
+    }
 
-    /* send file to ClamAV Server and wait for response (blocking operations) */
-    result = connection->sendString("INSTREAM");
-    if (!result) {
-        errmsg = "Cannot send stream to the ClamAV Server while processing scan of :" + std::string(filename);
-        logError("%s", errmsg.c_str());
+    /* connection problems are not fatal, circuit breakers of servers recover by themselves */
+    if (outcome == ScanCircuitOpen) {
+        errmsg = "Scanning failed - ClamAV Server is not available.";
+        scanningResult = AVCHK_FAILED;
+        logDebug("%s", errmsg);
+    }
+    else if (outcome == ScanOverloaded) {
+        /* the scan has waited in queue for QueueTimeout, it may succeed later */
+        errmsg = "Scanning failed - ClamAV Server is overloaded.";
+        scanningResult = AVCHK_FAILED;
+        logWarning("%s (%s)", errmsg, filename);
+    }
+    else if (outcome == ScanShed) {
+        /* overload policy: files above ShedSize are reported as impossible to check rather than queued */
+        errmsg = "Scanning failed - ClamAV Server is overloaded, large files are not scanned.";
+        scanningResult = AVCHK_IMPOSSIBLE;
+        logWarning("%s (%s)", errmsg, filename);
+    }
+    else if (outcome == ScanTooLarge) {
+        /* the file cannot be checked by this ClamAV Server at all, retrying later would not help */
+        errmsg = "Scanning failed - The file is larger than ClamAV Server accepts (StreamMaxLength).";
+        scanningResult = AVCHK_IMPOSSIBLE;
+        logDebug("%s (%s)", errmsg, filename);
+    }
+    else if (outcome == ScanFileError) {
+        /* the file has changed or become unreadable during upload, ClamAV Server is fine */
+        snprintf(vir_info, vi_size, "Cannot read file: %s", filename);
+        errmsg = vir_info;
+        scanningResult = AVCHK_FAILED;
+        logWarning("%s", errmsg);
+    }
+    else if (outcome == ScanNoServer) {
+        errmsg = "Scanning failed - Cannot connect to ClamAV Server.";
+        scanningResult = AVCHK_FAILED;
+        logError("%s", errmsg);
+    }
+    else if (outcome == ScanNotSent) {
+        snprintf(vir_info, vi_size, "Cannot send file to the ClamAV Server: %s", filename);
+        errmsg = vir_info;
+        scanningResult = AVCHK_FAILED;
+        logError("%s", errmsg);
     } 
-    else {
-        result = connection->sendFile(filename);
-        if (!result) {
-            errmsg = "Cannot send file to the ClamAV Server: " + std::string(filename);
-            logError("%s", errmsg.c_str());
+    else if (outcome == ScanTimedOut) {
+        errmsg = "Scanning failed - ClamAV Server has not answered in time.";
+        scanningResult = AVCHK_FAILED;
+        logWarning("%s (%s)", errmsg, filename);
+    }
+    else if (outcome == ScanNoReply) {
+        if (!answer.empty()) {
+            snprintf(vir_info, vi_size, "Scanning failed - The file cannot be scanned. Response: %s.", answer.c_str());
         } 
         else {
-            /* receive answer */
-            string answer;
-            result = connection->readString(answer);
-            if (!result) {
-                errmsg = "Scanning failed - The file cannot be scanned. ";
-                if (!answer.empty()) {
-                    errmsg += "Response: " + answer + ".";
-                } 
-                else {
-                    errmsg += "Scanner did not respond.";
-                }
-                logDebug("%s", errmsg.c_str());
-            } 
-            else {
-                /* parse answer from server */
-                logDebug("%s", answer.c_str());
-                if (answer == "OK") {
-                    errmsg = "Clean";
-                    scanningResult = AVCHK_OK;
-                }
-                else if (!answer.empty()) {
-                    string::size_type lastWord = answer.rfind(" "); // for example: "INSTREAM size limit exceeded. ERROR"
-                    if (lastWord != string::npos) {
-                        string msgType = answer.substr(lastWord + 1);
-                        answer.erase(answer.begin() + lastWord, answer.end());
-                        if (msgType == "FOUND") {
-                            errmsg = answer;
-
-                            /* check for special answers from server that indicates impossible file check */
-                            if ((0 == errmsg.compare(0, sizeof(encryptedMsg) - 1, encryptedMsg)) ||
-                                    (0 == errmsg.compare(0, sizeof(brokenMsg) - 1, brokenMsg)) ||
-                                    (0 == errmsg.compare(0, sizeof(heuristicsEncryptedMsg) - 1, heuristicsEncryptedMsg))) {
-                                scanningResult = AVCHK_IMPOSSIBLE;
-                            } 
-                            else {
-                                scanningResult = AVCHK_VIRUS_FOUND;
-                            }
-                        } 
-                        else {
-                            /* msgType contains ERROR or anything else */
-                            scanningResult = AVCHK_FAILED;
-                            errmsg = "Scanning failed - ClamAV Server returns error: " + answer;
-                        }
-                    }
-                }
-            }
+            strncpys(vir_info, "Scanning failed - The file cannot be scanned. Scanner did not respond.", vi_size);
         }
+        errmsg = vir_info;
+        scanningResult = AVCHK_FAILED;
+        logDebug("%s", errmsg);
+    } 
+    else {
+        /* parse answer from server */
+        logDebug("%s", answer.c_str());
+        scanningResult = classifyAnswer(answer, vir_info, vi_size);
+        errmsg = vir_info;
     }
 
     if (scanningResult != AVCHK_OK) {
-        logDebug("File scanning result: %s", errmsg.c_str());
+        logDebug("File scanning result: %s", errmsg);
     } 
     else {
         logDebug("File scanning finished successfully");
     }
 
-    strncpys(vir_info, errmsg.c_str(), vi_size);
+    if (errmsg != vir_info) {
+        strncpys(vir_info, errmsg, vi_size);
+    }
 
     atomicDec(&this->runningThreads);
     return scanningResult;
 }
 
-void ClamPlugin::startConnectionRefresh(SyncStreamPtr &conn)
+ClamPlugin::ScanOutcome ClamPlugin::scanFile(ThreadContext &context, const char *filename, int fd, unsigned long long size, 
+        const unsigned long long *key, std::string &answer)
 {
-    if (conn) {
-        MutexType::scoped_lock lock(this->connMutex);
-        this->connVector.push_back(conn);
+    Request &request = context.request;
+    long long leaseStart = monotonicMs();
+
+    /* try other servers when the chosen one cannot be reached, none of them twice */
+    PoolPtr tried[MAX_BACKEND_ATTEMPTS];
+    PoolPtr pool;
+    SessionPtr session;
+    size_t attempt = 0;
+    bool overloaded = false;
+    bool shed = false;
+    for (; !session && (attempt < MAX_BACKEND_ATTEMPTS); attempt++) {
+        pool = this->pickBackend(key, tried, attempt);
+        if (!pool) {
+            break;
+        }
+        tried[attempt] = pool;
+        session = pool->lease(&size, &overloaded, &shed);
+    }
+    if (!session) {
+        if (0 == attempt) {
+            answer = "ClamAV Server is not available.";
+            return ScanCircuitOpen;
+        }
+        if (shed) {
+            answer = "ClamAV Server is overloaded, large files are not scanned.";
+            return ScanShed;
+        }
+        if (overloaded) {
+            answer = "ClamAV Server is overloaded.";
+            return ScanOverloaded;
+        }
+        answer = "Cannot connect to ClamAV Server.";
+        return ScanNoServer;
     }
-}
 
-void ClamPlugin::dropConnectionRefresh(SyncStreamPtr &conn)
-{
-    if (conn) {
-        MutexType::scoped_lock lock(this->connMutex);
-        for (ThreadStreams::iterator i = this->connVector.begin(); i != this->connVector.end(); ++i) {
-            if (*i == conn) {
-                this->connVector.erase(i);
-                break;
+    bool sent = false;
+    bool result = false;
+    bool expired = false;
+    bool hedged = false;
+    PoolPtr hedgedBy;
+    bool streaming = this->scanCommand.empty();
+    long long verdictTime = pool->getVerdictTime(size);
+    long long uploadTime = -1;
+    long long start = monotonicMs();
+    long long queueTime = start - leaseStart;
+
+    /* let ClamAV Server read the file itself when it shares the file system with us */
+    if (!streaming) {
+        string path = this->mapPath(filename);
+        if (path.find('\n') != string::npos) {
+            streaming = true; // cannot be expressed in clamd command
+        }
+        else {
+            verdictCacheNoteDeadline((unsigned int) verdictTime);
+            request.reset(path.c_str());
+            sent = session->submit(request, this->scanCommand + " " + path);
+            result = sent && session->await(request, monotonicMs() + verdictTime, &expired);
+            answer = request.answer;
+            if (result && isAccessError(answer)) {
+                logDebug("ClamAV Server cannot access '%s' (%s), the file will be streamed", path.c_str(), answer.c_str());
+                streaming = true;
             }
         }
     }
+
+    /* files above StreamMaxLength of the server are refused without upload */
+    if (streaming && this->localSocket.empty() && pool->exceedsStreamLimit(size)) {
+        pool->release(session, &size);
+        answer = "The file is larger than StreamMaxLength of ClamAV Server.";
+        return ScanTooLarge;
+    }
+
+    /* send file to ClamAV Server and wait for response, each phase has its own deadline */
+    if (streaming) {
+        verdictCacheNoteDeadline((unsigned int) (pool->getUploadTime(size) + verdictTime));
+        request.reset();
+        start = monotonicMs();
+        bool fileError = false;
+        sent = session->submitFile(request, fd, size, start + pool->getUploadTime(size), &fileError);
+        if (fileError) {
+            /* not a failure of the server, it is neither blamed nor asked again */
+            pool->release(session, &size);
+            answer = "The file cannot be read.";
+            return ScanFileError;
+        }
+        if (sent) {
+            uploadTime = monotonicMs() - start;
+            start += uploadTime;
+        }
+        result = sent && this->awaitVerdict(context, filename, fd, size, key, pool, session, start, start + verdictTime, 
+                expired, answer, hedgedBy);
+        hedged = (hedgedBy.get() != NULL);
+    }
+
+    bool tooLarge = result && streaming && (0 == answer.compare(0, sizeof(sizeLimitMsg) - 1, sizeLimitMsg));
+    if (tooLarge && !hedged) {
+        pool->limitStream(size);
+    }
+    if (result && !hedged && !tooLarge) {
+        pool->measure(size, this->localSocket.empty() ? uploadTime : -1, monotonicMs() - start);
+    }
+    if (expired) {
+        pool->congested();
+    }
+    pool->release(session, &size);
+    pool->report(result);
+    scanJournalNote((hedged ? hedgedBy : pool)->getServer().c_str(), (unsigned int) queueTime, (unsigned int) std::max(uploadTime, 0LL), 
+            (unsigned int) (monotonicMs() - start), hedged);
+
+    if (!sent) {
+        answer = "Connection to ClamAV Server has failed.";
+        return ScanNotSent;
+    }
+    if (expired) {
+        return ScanTimedOut;
+    }
+    if (tooLarge) {
+        return ScanTooLarge;
+    }
+    return result ? ScanAnswered : ScanNoReply;
 }
 
-void ClamPlugin::keepAliveThreadWrapper(void *params)
+bool ClamPlugin::awaitVerdict(ThreadContext &context, const char *filename, int fd, unsigned long long size, 
+        const unsigned long long *key, const PoolPtr &pool, const SessionPtr &session, long long start, long long deadline, 
+        bool &expired, std::string &answer, PoolPtr &hedgedBy)
 {
-    if (params) {
-        ClamPlugin *th = (ClamPlugin *) params;
-        th->keepAliveThread();
+    Request &request = context.request;
+    Request &hedge = context.hedge;
+    bool result;
+
+    /* most verdicts arrive before the percentile, only the late ones are candidates for hedging */
+    this->hedgeBudget.earn();
+    long long hedgeAfter = this->latency.getPercentile(size, this->hedgePercentile);
+    PoolPtr other;
+    SessionPtr otherSession;
+    if ((hedgeAfter >= 0) && (start + hedgeAfter < deadline) && !request.wait(start + hedgeAfter) && !request.isDone() &&
+            (other = this->pickBackend(key, &pool, 1)) && (!this->localSocket.empty() || !other->exceedsStreamLimit(size)) && 
+            this->hedgeBudget.spend()) {
+        otherSession = other->tryLease(size);
+    }
+    if (!otherSession) {
+        result = session->await(request, deadline, &expired);
+        answer = request.answer;
+        if (result) {
+            this->latency.add(size, monotonicMs() - start);
+        }
+        return result;
+    }
+
+    logDebug("Verdict of %s from %s is late, the file is sent to %s too", filename, pool->getServer().c_str(), 
+            other->getServer().c_str());
+    hedge.reset();
+    long long hedgeStart = monotonicMs();
+    bool hedgeFileError = false;
+    bool hedgeSent = otherSession->submitFile(hedge, fd, size, hedgeStart + other->getUploadTime(size), &hedgeFileError);
+    long long hedgeUploaded = monotonicMs();
+    long long hedgeDeadline = hedgeUploaded + other->getVerdictTime(size);
+    if (hedgeSent && (hedgeDeadline > deadline)) {
+        verdictCacheNoteDeadline((unsigned int) (hedgeDeadline - hedgeUploaded));
     }
+    if (hedgeSent) {
+        (void) request.waitEither(hedge, std::max(deadline, hedgeDeadline));
+    }
+
+    /* the first verdict wins, the slower server is not blamed for the loss; an error reply of the hedge 
+       (e.g. above StreamMaxLength of the other server) does not win, the original request is awaited */
+    bool hedgeSucceeded = false;
+    bool hedgeVerdict = false;
+    bool hedgeDone = hedgeSent && hedge.isDone(&hedgeSucceeded, &hedgeVerdict);
+    if (hedgeSent) {
+        otherSession->withdraw(hedge); // also waits until the reactor has finished completing the hedge
+    }
+    if (request.wait(0) || !hedgeVerdict) {
+        result = session->await(request, deadline, &expired);
+        answer = request.answer;
+        if (result) {
+            this->latency.add(size, monotonicMs() - start);
+        }
+        if (!hedgeFileError) {
+            other->report(hedgeSucceeded || (hedgeSent && !hedgeDone && !otherSession->isBroken() && 
+                    (monotonicMs() < hedgeDeadline)));
+        }
+    }
+    else {
+        session->withdraw(request);
+        logDebug("Verdict of %s has been received from %s first", filename, other->getServer().c_str());
+        hedgedBy = other;
+        result = true;
+        answer = hedge.answer;
+        other->measure(size, this->localSocket.empty() ? hedgeUploaded - hedgeStart : -1, monotonicMs() - hedgeUploaded);
+        other->report(true);
+    }
+    other->release(otherSession, &size);
+    return result;
 }
 
-void ClamPlugin::keepAliveThread()
+std::string ClamPlugin::mapPath(const char *filename) const
 {
-    unsigned int timeout = KEEPALIVE_TIMEOUT;
-    std::string error;
+    std::string path(filename);
 
-    while (!closing) {
-        timeout--;
-        boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
-        if (0 == timeout) {
-            MutexType::scoped_lock lock(this->connMutex);
+    if (!this->pathPrefix.empty() && (0 == path.compare(0, this->pathPrefix.size(), this->pathPrefix))) {
+        path.replace(0, this->pathPrefix.size(), this->serverPathPrefix);
+    }
+    return path;
+}
 
-            if (this->connVector.empty()) {
-                continue;
+bool ClamPlugin::resolveServers(std::vector<std::string> &servers, std::string &error)
+{
+    servers.clear();
+
+    for (std::vector<std::string>::iterator i = this->addresses.begin(); i != this->addresses.end(); ++i) {
+        std::string host;
+        std::string port = this->port;
+        splitHostPort(*i, host, port);
+
+        try {
+            boost::asio::io_service io_service;
+            boost::asio::ip::tcp::resolver resolver(io_service);
+            boost::asio::ip::tcp::resolver::query query(host.c_str(), "");
+            boost::asio::ip::tcp::resolver::iterator iter = resolver.resolve(query);
+            boost::asio::ip::tcp::resolver::iterator end;
+
+            for (; iter != end; ++iter) {
+                boost::asio::ip::address addr = iter->endpoint().address();
+                stringstream hostPort;
+                hostPort << addr.to_string() << ":" << port;
+                if (std::find(servers.begin(), servers.end(), hostPort.str()) == servers.end()) {
+                    servers.push_back(hostPort.str());
+                    logDebug("ClamAV Server IP address: %s", hostPort.str().c_str());
+                }
             }
-            /* timeout has occurred */
-            for (ThreadStreams::iterator i = this->connVector.begin(); i != this->connVector.end(); ++i) {
-                (void) (*i)->sendPingPong(error);
-            }            
-            timeout = KEEPALIVE_TIMEOUT;
         }
+        catch (std::exception &e) {
+            error = "Cannot resolve host (" + host + "). Error: " + std::string(e.what());
+            logWarning("%s", error.c_str());
+        }
+    }
+
+    if (servers.empty()) {
+        if (error.empty()) {
+            error = "Cannot resolve host (" + (this->addresses.empty() ? std::string() : this->addresses.front()) + ").";
+        }
+        return false;
     }
+    return true;
 }
 
-bool ClamPlugin::SyncStream::startSession()
+void ClamPlugin::updateBackends(const std::vector<std::string> &servers)
 {
-    MutexType::scoped_lock lock(*mutex.get());
+    Backends closed;
+    {
+        MutexType::scoped_lock lock(this->backendsMutex);
+
+        Backends updated;
+        for (std::vector<std::string>::const_iterator i = servers.begin(); i != servers.end(); ++i) {
+            PoolPtr pool;
+            for (Backends::iterator j = this->backends.begin(); j != this->backends.end(); ++j) {
+                if ((*j)->getServer() == *i) {
+                    pool = *j;
+                    break;
+                }
+            }
+            if (!pool) {
+                pool.reset(new Pool(*i, this->poolConfig));
+                if (!this->backends.empty()) {
+                    logDebug("ClamAV Server %s has been added", i->c_str());
+                }
+            }
+            updated.push_back(pool);
+        }
 
-    logDebug("Sending SESSION command...");
-    return sendString("IDSESSION");
+        for (Backends::iterator j = this->backends.begin(); j != this->backends.end(); ++j) {
+            if (std::find(updated.begin(), updated.end(), *j) == updated.end()) {
+                if (!servers.empty()) {
+                    logDebug("ClamAV Server %s has been removed", (*j)->getServer().c_str());
+                }
+                this->retired.push_back(*j);
+            }
+        }
+        this->backends.swap(updated);
+
+        /* retired pools are closed once their scans finish, all of them on plugin close */
+        for (Backends::iterator j = this->retired.begin(); j != this->retired.end(); ) {
+            if (servers.empty() || (0 == (*j)->getLoad())) {
+                closed.push_back(*j);
+                j = this->retired.erase(j);
+            }
+            else {
+                ++j;
+            }
+        }
+    }
+
+    for (Backends::iterator i = closed.begin(); i != closed.end(); ++i) {
+        (*i)->close();
+    }
 }
 
-bool ClamPlugin::SyncStream::getVersion(std::string &version)
+ClamPlugin::PoolPtr ClamPlugin::pickBackend(const unsigned long long *affinityKey, const PoolPtr *exclude, size_t excluded)
 {
-    MutexType::scoped_lock lock(*mutex.get());
+    MutexType::scoped_lock lock(this->backendsMutex);
+
+    /* one pass without building list of available backends: rendezvous maximum, or two random ones by reservoir sampling */
+    unsigned long long random = mix64((unsigned long long) atomicInc(&this->balancerCounter) ^ (unsigned long long) monotonicMs());
+    const PoolPtr *chosen[2] = {NULL, NULL};
+    const PoolPtr *best = NULL;
+    unsigned long long bestScore = 0;
+    size_t count = 0;
+    for (Backends::const_iterator i = this->backends.begin(); i != this->backends.end(); ++i) {
+        if ((std::find(exclude, exclude + excluded, *i) != exclude + excluded) || !(*i)->isAvailable()) {
+            continue;
+        }
+        if (affinityKey) {
+            const std::string &server = (*i)->getServer();
+            unsigned long long score = mix64(*affinityKey ^ fnv1a(server.data(), server.size()));
+            if (!best || (score > bestScore)) {
+                best = &(*i);
+                bestScore = score;
+            }
+        }
+        else if (count < 2) {
+            chosen[count] = &(*i);
+        }
+        else {
+            size_t slot = mix64(random + count) % (count + 1);
+            if (slot < 2) {
+                chosen[slot] = &(*i);
+            }
+        }
+        count++;
+    }
 
-    logDebug("Sending VERSION command...");
-    if (!sendString("VERSION")) {
-        logWarning("Cannot send VERSION command to the ClamAV Server");
-        version = "unknown";
-        return true;
+    if (count == 0) {
+        return PoolPtr(); // circuit breakers of all other servers are open
     }
-    if (!readString(version)) {
-        logDebug("Cannot read response from ClamAV Server session, error: %s", version.c_str());
-        return false;
+    if (affinityKey) {
+        return *best;
+    }
+    if (count == 1) {
+        return *chosen[0];
     }
 
-    return true;
+    /* power of two choices */
+    return ((*chosen[0])->getLoad() <= (*chosen[1])->getLoad()) ? *chosen[0] : *chosen[1];
 }
 
-bool ClamPlugin::SyncStream::endSession()
+ClamPlugin::Backends ClamPlugin::getBackends()
 {
-    MutexType::scoped_lock lock(*mutex.get());
+    MutexType::scoped_lock lock(this->backendsMutex);
 
-    logDebug("Sending END command...");
-    return sendString("END");
+    return this->backends;
 }
 
-bool ClamPlugin::SyncStream::sendPingPong(std::string &error)
+void ClamPlugin::keepAliveThreadWrapper(void *params)
 {
-    MutexType::scoped_try_lock lock(*mutex.get());
-    if (!lock) {
-        logDebug("Ping pong not needed");
-        return true; // no ping pong needed, stream is being used right now (aquired by testFile call)
+    if (params) {
+        ClamPlugin *th = (ClamPlugin *) params;
+        th->keepAliveThread();
     }
+}
 
-    string answer;
-    bool result = false;
+void ClamPlugin::keepAliveThread()
+{
+    long long pingAfter = (long long) std::max(this->idleTimeout - KEEPALIVE_MARGIN, 1) * 1000;
+    long long nextResolve = monotonicMs() + (long long) this->resolveInterval * 1000;
+    long long nextVersionCheck = monotonicMs() + VERSION_CHECK_INTERVAL * 1000;
+    long long nextStatsCheck = monotonicMs() + (long long) this->statsInterval * 1000;
+    std::string error;
 
-    if (stream == NULL) {
-        error = "Stream is empty.";
-        logError("%s", error.c_str());
-        return false;
+    while (!closing) {
+        long long now = monotonicMs();
+
+        logReloadLevel();
+
+        /* servers may be added or removed in DNS */
+        if (this->localSocket.empty() && (this->resolveInterval > 0) && (now >= nextResolve)) {
+            std::vector<std::string> servers;
+            if (this->resolveServers(servers, error)) {
+                this->updateBackends(servers);
+            }
+            nextResolve = now + (long long) this->resolveInterval * 1000;
+        }
+
+        /* only sessions idle for almost IdleTimeout of clamd are pinged, busy sessions are kept alive by replies */
+        Backends current = this->getBackends();
+        Backends pools;
+        Sessions due;
+        long long next = now + MAINTENANCE_INTERVAL * 1000;
+        for (Backends::iterator i = current.begin(); i != current.end() && !closing; ++i) {
+            (*i)->trim();
+            (*i)->probe();
+            next = earliest(next, (*i)->schedule(monotonicMs(), pingAfter, due));
+            pools.resize(due.size(), *i);
+        }
+        if (!due.empty() && !closing) {
+            this->pingSessions(pools, due);
+        }
+        if ((monotonicMs() >= nextVersionCheck) && !closing) {
+            this->checkVersions();
+            nextVersionCheck = monotonicMs() + VERSION_CHECK_INTERVAL * 1000;
+        }
+        next = earliest(next, nextVersionCheck);
+
+        /* load of ClamAV Servers, also caused by other clients, drives concurrency limits */
+        if ((this->statsInterval > 0) && (monotonicMs() >= nextStatsCheck)) {
+            for (Backends::iterator i = current.begin(); i != current.end() && !closing; ++i) {
+                if ((*i)->isAvailable()) {
+                    (*i)->checkStats();
+                }
+            }
+            nextStatsCheck = monotonicMs() + (long long) this->statsInterval * 1000;
+        }
+        if (this->statsInterval > 0) {
+            next = earliest(next, nextStatsCheck);
+        }
+        if (this->localSocket.empty() && (this->resolveInterval > 0)) {
+            next = earliest(next, nextResolve);
+        }
+
+        MutexType::scoped_lock lock(this->scheduleMutex);
+        long long left = next - monotonicMs();
+        if (!closing && (left > 0)) {
+            this->scheduleChanged.timed_wait(lock, boost::posix_time::milliseconds(left));
+        }
     }
+}
 
-    logDebug("Sending PING command...");
-    result = sendString("PING");
-    if (!result) {
-        logWarning("Cannot send PING command");
-        return false;
+void ClamPlugin::checkVersions()
+{
+    Backends current = this->getBackends();
+    std::set<std::string> versions;
+
+    for (Backends::iterator i = current.begin(); i != current.end(); ++i) {
+        if ((*i)->isAvailable()) {
+            SessionPtr session = (*i)->lease();
+            if (session) {
+                std::string version;
+                bool result = session->getVersion(version) && (version != "unknown");
+                (*i)->release(session);
+                (*i)->report(result);
+                if (result) {
+                    this->engineVersions[(*i)->getServer()] = version;
+                }
+            }
+        }
+
+        /* unreachable server keeps its last known version */
+        std::map<std::string, std::string>::iterator known = this->engineVersions.find((*i)->getServer());
+        if (known != this->engineVersions.end()) {
+            versions.insert(known->second);
+        }
     }
 
-    if (!readString(answer)) {
-        error = "Cannot read response from ClamAV Server session.";
-        logError("%s", error.c_str());
-        return false;
+    std::string combined;
+    for (std::set<std::string>::iterator i = versions.begin(); i != versions.end(); ++i) {
+        combined += (combined.empty() ? "" : "; ") + *i;
     }
-    if (answer != "PONG") {
-        error = "An incorrect answer has been received from ClamAV Server '" + answer + "'.";
-        logError("%s", error.c_str());
-        return false;
+    if (!combined.empty()) {
+        verdictCacheSetEngineVersion(combined.c_str());
+    }
+}
+
+void ClamPlugin::pingSessions(const Backends &pools, const Sessions &sessions)
+{
+    std::vector<boost::shared_ptr<Request> > requests(sessions.size());
+
+    logDebug("Sending PING command to %u idle sessions...", (unsigned int) sessions.size());
+    for (size_t i = 0; i < sessions.size(); i++) {
+        requests[i].reset(new Request());
+        if (!sessions[i]->submit(*requests[i], "PING")) {
+            requests[i].reset();
+            pools[i]->report(false);
+        }
+    }
+
+    /* the slowest session delays the others by its own reply time only */
+    long long deadline = monotonicMs() + (long long) this->timeout * 1000;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (!requests[i]) {
+            continue;
+        }
+        if (!sessions[i]->await(*requests[i], deadline) || (requests[i]->answer != "PONG")) {
+            logWarning("ClamAV Server %s has not answered PING: %s", pools[i]->getServer().c_str(), 
+                    requests[i]->answer.c_str());
+            pools[i]->report(false);
+        }
     }
-    return true;
 }
@@ -9,6 +9,9 @@
 
 #include <string>
 #include <sstream>
+#include <map>
+#include <set>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
@@ -102,9 +105,33 @@ private:
     } PluginState;
 
     /**
-     * Pointer to TCP stream
+     * Outcome of one attempt to scan a file
      */
-    typedef boost::shared_ptr<boost::asio::ip::tcp::iostream> TCPClientStreamPtr;
+    typedef enum _ScanOutcome {
+        ScanAnswered = 0,
+        ScanNoServer,
+        ScanNotSent,
+        ScanNoReply,
+        ScanTimedOut,
+        ScanCircuitOpen,
+        ScanOverloaded,
+        ScanShed,
+        ScanTooLarge,
+        ScanFileError
+    } ScanOutcome;
+
+    /**
+     * Size classes of scanned files, each class has its own sessions and reserved share of concurrency limit,
+     * so that huge files do not block small ones
+     */
+    typedef enum _Lane {
+        LaneSmall = 0,
+        LaneMedium,
+        LaneLarge,
+        LaneCount
+    } Lane;
+
+    class Request;
 
     /**
      * Mutex type
@@ -112,100 +139,1174 @@ private:
     typedef boost::mutex MutexType;
     
     /**
-     * Mutex pointer
+     * Connection to ClamAV Server, non-blocking socket
      */
-    typedef boost::shared_ptr<MutexType> MutexPtr;
-    
+    class SyncStream {
+        int sock;
+        bool local;
+        int timeout;
+
+        /**
+         * Received data not consumed by nextReply yet
+         */
+        std::string buffer;
+
+        /**
+         * Close the socket
+         * 
+         * \return (void)
+         */
+        void close();
+
+    public:
+        /**
+         * Constructor
+         */
+        SyncStream(int _timeout)
+            :sock(-1),local(false),timeout(_timeout) {            
+        }
+
+        /**
+         * Destructor, closes the socket
+         */
+        ~SyncStream() {
+            close();
+        }
+        
+        /**
+         * Connect to server, waits for the connection by poll(2) at most the timeout given to constructor
+         * 
+         * \param server server address with port separater by colon or absolute path of clamd local socket
+         * \return true on success, false otherwise
+         */
+        bool connect(std::string &server);
+
+        /**
+         * Native socket descriptor of connected stream
+         * 
+         * \return (int) descriptor
+         */
+        int nativeHandle();
+
+        /**
+         * Whether the stream is connected to clamd local (Unix domain) socket
+         * 
+         * \return (bool) result
+         */
+        bool isLocal() const;
+        
+        /**
+         * Receive data available on the socket without blocking
+         * 
+         * \return (bool) false if the connection has been closed or has failed
+         */
+        bool receive();
+
+        /**
+         * Take one complete reply from received data, never blocks
+         * 
+         * \param output (string &) reply without id and stream prefix
+         * \param id (unsigned int *) id of operation
+         * \return (bool) false if no complete reply has been received yet
+         */
+        bool nextReply(std::string &output, unsigned int *id = NULL);
+
+        /**
+         * Send string to ClamAV Server
+         * 
+         * \param input (const string &) data
+         * \return (bool) result
+         */
+        bool sendString(const std::string & input);
+
+        /**
+         * Send file to ClamAV Server using INSTREAM command
+         * 
+         * \param fd (int) descriptor of the file, it is read by offset and may be shared
+         * \param size (unsigned long long) file size
+         * \param chunkSize (size_t) size of INSTREAM chunks in bytes
+         * \param deadline (long long) time from monotonic clock by which the upload must finish
+         * \param request (Request *) the upload stops when the request is answered before the whole file is sent, 
+         * may be NULL
+         * \param fileError (bool *) set to true when the file could not be read, e.g. it has been truncated meanwhile, 
+         * the stream is then completed with zero bytes and stays usable, may be NULL
+         * \return (bool) result
+         */
+        bool sendFile(int fd, unsigned long long size, size_t chunkSize, long long deadline, Request *request = NULL, 
+                bool *fileError = NULL);
+
+        /**
+         * Pass open file descriptor to ClamAV Server using FILDES command, local socket only
+         * 
+         * \param fd (int) descriptor of the file
+         * \param deadline (long long) time from monotonic clock by which the descriptor must be sent
+         * \return (bool) result
+         */
+        bool sendDescriptor(int fd, long long deadline);
+
+        /**
+         * Send NUL-terminated command outside of session and read its whole reply, e.g. multi-line STATS
+         * 
+         * \param command (const std::string &) command without prefix
+         * \param reply (std::string &) reply
+         * \param deadline (long long) time from monotonic clock
+         * \return (bool) result
+         */
+        bool query(const std::string &command, std::string &reply, long long deadline);
+
+        /**
+         * Shut the socket down, the reactor is woken up by end of stream
+         * 
+         * \return (void)
+         */
+        void shutdown();
+    };
+
+    /**
+     * Pointer to SyncStream
+     */
+    typedef boost::shared_ptr<SyncStream> SyncStreamPtr;
+
+    /**
+     * Request waiting for its reply on a multiplexed session
+     */
+    class Request {
+        MutexType mutex;
+        boost::condition_variable ready;
+        bool done;
+        bool failed;
+        bool verdict;
+
+    public:
+        /**
+         * Path sent with SCAN command, its reply prefix is stripped
+         */
+        const char *path;
+
+        /**
+         * Reply of ClamAV Server or error message
+         */
+        std::string answer;
+
+        /**
+         * Id of the request on its session
+         */
+        unsigned int id;
+
+        /**
+         * Time from monotonic clock when the request was sent
+         */
+        long long submitted;
+
+        /**
+         * Request woken up as well when this one completes, see waitEither()
+         */
+        Request *partner;
+
+        /**
+         * Constructor
+         */
+        Request()
+            :done(false),failed(false),verdict(false),path(NULL),id(0),submitted(0),partner(NULL) {
+        }
+
+        /**
+         * Prepare the request for next use
+         * 
+         * \param _path (const char *) path sent with SCAN command or NULL
+         * \return (void)
+         */
+        void reset(const char *_path = NULL);
+
+        /**
+         * Store the reply and wake up waiting thread
+         * 
+         * \param reply (const std::string &) reply or error message
+         * \param error (bool) true if reply was not received
+         * \return (void)
+         */
+        void complete(const std::string &reply, bool error);
+
+        /**
+         * Complete the request with error unless its reply has arrived meanwhile
+         * 
+         * \param error (const char *) error message
+         * \return (bool) true if the request has been completed by this call
+         */
+        bool expire(const char *error);
+
+        /**
+         * Wait for reply
+         * 
+         * \param deadline (long long) time from monotonic clock, negative value means no deadline
+         * \return (bool) true if reply was received, false if connection has failed or deadline has passed
+         */
+        bool wait(long long deadline = -1);
+
+        /**
+         * Wait until this request has received reply, the other one has received verdict (clean or infected), 
+         * or both are done. The other request must have this one as its partner.
+         * 
+         * \param other (Request &) request racing with this one
+         * \param deadline (long long) time from monotonic clock
+         * \return (bool) false if deadline has passed
+         */
+        bool waitEither(Request &other, long long deadline);
+
+        /**
+         * Whether the request has been completed
+         * 
+         * \param succeeded (bool *) set to true if reply was received, may be NULL
+         * \param hasVerdict (bool *) set to true if the reply is clean or infected verdict rather than error, may be NULL
+         * \return (bool) result
+         */
+        bool isDone(bool *succeeded = NULL, bool *hasVerdict = NULL);
+    };
+
+    /**
+     * Recent verdict times by file size class, tells when a scan is late
+     */
+    class LatencyTracker {
+        MutexType mutex;
+
+        /**
+         * Histogram of logarithmic time bins for each size class, halved when it is full
+         */
+        std::vector<unsigned int> bins;
+        std::vector<unsigned int> totals;
+
+        /**
+         * Size class of a file
+         * 
+         * \param size (unsigned long long) file size
+         * \return (size_t) index of the class
+         */
+        static size_t getClass(unsigned long long size);
+
+    public:
+        /**
+         * Constructor
+         */
+        LatencyTracker();
+
+        /**
+         * Record verdict time of a scan
+         * 
+         * \param size (unsigned long long) file size
+         * \param time (long long) milliseconds from end of upload to reply
+         * \return (void)
+         */
+        void add(unsigned long long size, long long time);
+
+        /**
+         * Verdict time not exceeded by given percentage of recent scans of similar size
+         * 
+         * \param size (unsigned long long) file size
+         * \param percentile (int) percentage
+         * \return (long long) milliseconds, negative when too few scans have been recorded
+         */
+        long long getPercentile(unsigned long long size, int percentile);
+    };
+
+    /**
+     * Token bucket limiting hedged scans to a percentage of all scans
+     */
+    class HedgeBudget {
+        MutexType mutex;
+        double tokens;
+        double rate;
+
+    public:
+        /**
+         * Constructor
+         */
+        HedgeBudget()
+            :tokens(0.0),rate(0.0) {
+        }
+
+        /**
+         * Set the budget
+         * 
+         * \param percent (int) hedged scans per hundred scans, 0 disables hedging
+         * \return (void)
+         */
+        void setPercent(int percent);
+
+        /**
+         * Credit the budget by one scan
+         * 
+         * \return (void)
+         */
+        void earn();
+
+        /**
+         * Take one hedge from the budget
+         * 
+         * \return (bool) false if the budget is exhausted
+         */
+        bool spend();
+    };
+
+    class Reactor;
+
+    /**
+     * IDSESSION connection shared by many scanning threads. Requests are written one after another 
+     * and replies are matched back to waiting requests by reply id in the reactor thread.
+     */
+    class Session {
+        SyncStreamPtr stream;
+        MutexType writeMutex;
+        MutexType pendingMutex;
+
+        /**
+         * Requests waiting for reply and their ids, at most a few per session, so a vector which keeps 
+         * its capacity is cheaper than a map allocating node per request
+         */
+        std::vector<std::pair<unsigned int, Request *> > pending;
+
+        /**
+         * Remove request from pending requests, pendingMutex must be held
+         * 
+         * \param id (unsigned int) id of the request
+         * \return (Request *) removed request or NULL
+         */
+        Request *takePending(unsigned int id);
+
+        /**
+         * Id of last request sent, ClamAV Server numbers requests of a session from 1
+         */
+        unsigned int lastId;
+
+        /**
+         * Time from monotonic clock when the last reply has been received
+         */
+        long long lastReply;
+
+        /**
+         * Time from monotonic clock when a request was sent or a reply received
+         */
+        long long lastActivity;
+
+        /**
+         * Seconds to wait for replies of PING and VERSION
+         */
+        int replyTimeout;
+
+        /**
+         * Size of INSTREAM chunks in bytes
+         */
+        size_t chunkSize;
+
+        volatile bool broken;
+
+        /**
+         * Reactor dispatching replies, the session is registered while it is open
+         */
+        Reactor *reactor;
+        bool registered;
+
+        /**
+         * Reply being dispatched, kept to reuse its buffer, used by the reactor thread only
+         */
+        std::string reply;
+
+        /**
+         * Register request and assign it next id, must be called with writeMutex held
+         * 
+         * \param request (Request &) request
+         * \return (unsigned int) id
+         */
+        unsigned int enqueue(Request &request);
+
+        /**
+         * Remove request which cannot be sent
+         * 
+         * \param id (unsigned int) id of the request
+         * \return (void)
+         */
+        void cancel(unsigned int id);
+
+        /**
+         * Mark session broken, fail all pending requests and shut connection down
+         * 
+         * \param error (const std::string &) error message
+         * \return (void)
+         */
+        void fail(const std::string &error);
+
+    public:
+        /**
+         * Constructor
+         * 
+         * \param connectTimeout seconds for connect and command writes
+         * \param _replyTimeout seconds to wait for replies of PING and VERSION
+         * \param _chunkSize size of INSTREAM chunks in bytes
+         * \param _reactor reactor dispatching replies
+         */
+        Session(int connectTimeout, int _replyTimeout, size_t _chunkSize, Reactor *_reactor);
+
+        /**
+         * Destructor
+         */
+        ~Session();
+
+        /**
+         * Connect to server and start IDSESSION
+         * 
+         * \param server (std::string &) server address, see SyncStream::connect
+         * \return (bool) result
+         */
+        bool open(std::string &server);
+
+        /**
+         * End session and close connection
+         * 
+         * \return (void)
+         */
+        void close();
+
+        /**
+         * Send command, reply is delivered to request
+         * 
+         * \param request (Request &) request to be completed with reply
+         * \param command (const std::string &) command
+         * \return (bool) false if the command cannot be sent
+         */
+        bool submit(Request &request, const std::string &command);
+
+        /**
+         * Send file by INSTREAM or FILDES (local socket), reply is delivered to request
+         * 
+         * \param request (Request &) request to be completed with reply
+         * \param fd (int) descriptor of the file
+         * \param size (unsigned long long) file size
+         * \param deadline (long long) time from monotonic clock by which the file must be sent
+         * \param fileError (bool *) set to true when the file could not be read, which is not a failure of the server, 
+         * may be NULL
+         * \return (bool) false if the file cannot be sent, true also when ClamAV Server has refused it 
+         * before the upload finished (e.g. above StreamMaxLength)
+         */
+        bool submitFile(Request &request, int fd, unsigned long long size, long long deadline, bool *fileError = NULL);
+
+        /**
+         * Wait for reply of submitted request. Expired request is withdrawn, the session is failed 
+         * when nothing has been received since the request was sent, i.e. ClamAV Server is stuck.
+         * 
+         * \param request (Request &) submitted request
+         * \param deadline (long long) time from monotonic clock
+         * \param expired (bool *) set to true when deadline has passed, may be NULL
+         * \return (bool) true if reply was received
+         */
+        bool await(Request &request, long long deadline, bool *expired = NULL);
+
+        /**
+         * Give up submitted request whose verdict is no longer needed, its late reply is ignored
+         * 
+         * \param request (Request &) submitted request
+         * \return (void)
+         */
+        void withdraw(Request &request);
+
+        /**
+         * Send PING and receive PONG (clam protocol)
+         * 
+         * \param error (std::string &) error message when return value is false
+         * \return (bool) result
+         */
+        bool sendPingPong(std::string &error);
+
+        /**
+         * Get version
+         * 
+         * \param version (std::string &) result
+         * \return (bool)
+         */
+        bool getVersion(std::string &version);
+
+        /**
+         * Whether the connection has failed
+         * 
+         * \return (bool) result
+         */
+        bool isBroken() const;
+
+        /**
+         * Start of idle period of the session
+         * 
+         * \return (long long) time from monotonic clock of last activity, negative when requests are pending
+         */
+        long long getIdleSince();
+
+        /**
+         * Receive replies available on the connection and complete their requests, called by the reactor 
+         * thread when the socket is readable. Fails the session when the connection is closed.
+         * 
+         * \return (void)
+         */
+        void dispatch();
+    };
+
+    /**
+     * Pointer to Session
+     */
+    typedef boost::shared_ptr<Session> SessionPtr;
+
+    /**
+     * Vector of sessions
+     */
+    typedef std::vector<SessionPtr> Sessions;
+
+    /**
+     * Event loop of all sessions, one thread waits for readable sockets (epoll on Linux, poll elsewhere) 
+     * and dispatches replies, so that scanning threads only park on their requests.
+     */
+    class Reactor {
+        MutexType mutex;
+
+        /**
+         * Registered sessions and their sockets
+         */
+        std::vector<std::pair<Session *, int> > sessions;
+
+        /**
+         * Session being dispatched, signalled by dispatched when it is done
+         */
+        Session *current;
+        boost::condition_variable dispatched;
+
+        boost::thread *thread;
+        volatile bool stopping;
+        int pollFd;
+
+        /**
+         * Pipe waking the loop up when it should stop, or when sessions change (poll only)
+         */
+        int wakeFds[2];
+
+        /**
+         * Wake the loop up
+         * 
+         * \return (void)
+         */
+        void wake();
+
+        /**
+         * Dispatch readable session unless it has been removed meanwhile
+         * 
+         * \param session (Session *) session
+         * \return (void)
+         */
+        void dispatch(Session *session);
+
+        /**
+         * Loop of the reactor thread
+         * 
+         * \return (void)
+         */
+        void run();
+
+    public:
+        /**
+         * Constructor
+         */
+        Reactor();
+
+        /**
+         * Destructor
+         */
+        ~Reactor();
+
+        /**
+         * Start the reactor thread, does nothing when it runs already
+         * 
+         * \return (bool) result
+         */
+        bool start();
+
+        /**
+         * Stop the reactor thread, sessions which are still registered are no longer dispatched
+         * 
+         * \return (void)
+         */
+        void stop();
+
+        /**
+         * Dispatch session whenever its socket is readable
+         * 
+         * \param session (Session *) session
+         * \param fd (int) socket of the session
+         * \return (bool) result
+         */
+        bool add(Session *session, int fd);
+
+        /**
+         * Stop dispatching session, waits until its running dispatch finishes unless called by the reactor thread.
+         * Must be called without locks of the session held.
+         * 
+         * \param session (Session *) session
+         * \return (void)
+         */
+        void remove(Session *session);
+    };
+
+    /**
+     * Circuit breaker of one ClamAV Server. Closed breaker admits every scan, failures open it and scans are 
+     * refused immediately until open time elapses, then it is half-open and admits a single probe whose result 
+     * closes or re-opens it. Not thread safe, guarded by mutex of the owning Pool.
+     */
+    class CircuitBreaker {
+        /**
+         * Breaker states
+         */
+        typedef enum _BreakerState {
+            BreakerClosed = 0,
+            BreakerOpen,
+            BreakerHalfOpen
+        } BreakerState;
+
+        BreakerState state;
+        int threshold;
+        int openTime;
+
+        /**
+         * Count of failures since last success
+         */
+        int failures;
+
+        /**
+         * Time from monotonic clock when open breaker becomes half-open
+         */
+        long long openUntil;
+
+        /**
+         * Whether the probe of half-open breaker is in progress
+         */
+        bool probing;
+
+    public:
+        /**
+         * Constructor
+         * 
+         * \param _threshold count of consecutive failures which opens the breaker
+         * \param _openTime seconds for which open breaker refuses scans
+         */
+        CircuitBreaker(int _threshold, int _openTime);
+
+        /**
+         * Admit one attempt, half-open breaker admits only one probe at a time
+         * 
+         * \param now (long long) time from monotonic clock
+         * \return (bool) whether the attempt may be done
+         */
+        bool allow(long long now);
+
+        /**
+         * Whether allow() would admit an attempt
+         * 
+         * \param now (long long) time from monotonic clock
+         * \return (bool) result
+         */
+        bool isAllowed(long long now) const;
+
+        /**
+         * Whether the breaker is closed, i.e. server is healthy
+         * 
+         * \return (bool) result
+         */
+        bool isClosed() const;
+
+        /**
+         * Whether open breaker waits for a probe
+         * 
+         * \param now (long long) time from monotonic clock
+         * \return (bool) result
+         */
+        bool isProbeDue(long long now) const;
+
+        /**
+         * Time when open breaker becomes half-open
+         * 
+         * \return (long long) time from monotonic clock, negative when the breaker is not open
+         */
+        long long getProbeTime() const;
+
+        /**
+         * Record successful exchange with the server
+         * 
+         * \return (bool) true when the breaker has been closed by this call
+         */
+        bool success();
+
+        /**
+         * Record failed exchange with the server
+         * 
+         * \param now (long long) time from monotonic clock
+         * \param trip (bool) open the breaker regardless of threshold
+         * \return (bool) true when the breaker has been opened by this call
+         */
+        bool failure(long long now, bool trip);
+    };
+
+    /**
+     * Additive-increase/multiplicative-decrease limit of scans in progress on one ClamAV Server.
+     * Not thread safe, guarded by mutex of the owning Pool.
+     */
+    class ConcurrencyLimiter {
+        double limit;
+        double maxLimit;
+
+        /**
+         * Time from monotonic clock of the last decrease, one congestion episode decreases the limit once
+         */
+        long long lastDecrease;
+
+    public:
+        /**
+         * Constructor
+         * 
+         * \param initial initial limit
+         * \param maximum upper bound of the limit
+         */
+        ConcurrencyLimiter(size_t initial, size_t maximum);
+
+        /**
+         * Current limit
+         * 
+         * \return (size_t) count of scans
+         */
+        size_t getLimit() const;
+
+        /**
+         * Raise the limit after a scan answered in time, only when the limit is actually reached
+         * 
+         * \param load (size_t) count of scans in progress
+         * \return (void)
+         */
+        void grow(size_t load);
+
+        /**
+         * Lower the limit after a sign of congestion
+         * 
+         * \param now (long long) time from monotonic clock
+         * \return (bool) true if the limit has been lowered
+         */
+        bool shrink(long long now);
+    };
+
+    /**
+     * Parameters of pools
+     */
+    struct PoolConfig {
+        /**
+         * Timeout in seconds for connect and lease
+         */
+        int timeout;
+
+        /**
+         * Count of sessions kept open
+         */
+        size_t minSize;
+
+        /**
+         * Maximal count of sessions
+         */
+        size_t maxSize;
+
+        /**
+         * Maximal count of scans multiplexed on one session
+         */
+        size_t depth;
+
+        /**
+         * Seconds after which unused session above minimum is closed
+         */
+        int idleTime;
+
+        /**
+         * Count of consecutive failed scans which opens circuit breaker, connect failure opens it immediately
+         */
+        int breakerThreshold;
+
+        /**
+         * Seconds for which open circuit breaker refuses scans
+         */
+        int breakerOpenTime;
+
+        /**
+         * Seconds to connect a session and to write a command
+         */
+        int connectTimeout;
+
+        /**
+         * Upper bound in seconds of upload and verdict deadlines of one scan
+         */
+        int scanTimeout;
+
+        /**
+         * Seconds a scan waits when concurrency limit of the server is reached
+         */
+        int queueTimeout;
+
+        /**
+         * Whether files larger than shedSize are refused instead of waiting at concurrency limit
+         */
+        bool shed;
+        unsigned long long shedSize;
+
+        /**
+         * Smallest sizes of files in medium and large lanes
+         */
+        unsigned long long mediumSize;
+        unsigned long long largeSize;
+
+        /**
+         * Size of INSTREAM chunks, and largest file accepted by INSTREAM (0 until it is learned)
+         */
+        size_t chunkSize;
+        unsigned long long streamLimit;
+
+        /**
+         * Reactor dispatching replies of sessions
+         */
+        Reactor *reactor;
+    };
+
     /**
-     * One thread context
+     * Plugin-wide pool of sessions to one ClamAV Server. Sessions are pre-opened, leased for 
+     * one scan and multiplexed up to pipeline depth, idle sessions above minimum are closed.
      */
-    class SyncStream {
-        TCPClientStreamPtr stream;        
-        int timeout;
-        
+    class Pool {
+        /**
+         * Pooled session and its usage
+         */
+        struct Entry {
+            SessionPtr session;
+            size_t leases;
+            long long lastUsed;
+            Lane lane;
+        };
+
+        std::string server;
+        PoolConfig config;
+
+        MutexType mutex;
+        boost::condition_variable released;
+        std::vector<Entry> entries;
+
+        /**
+         * Count of sessions being connected outside of the lock
+         */
+        size_t opening;
+        bool closed;
+
+        /**
+         * Health of the server
+         */
+        CircuitBreaker breaker;
+
+        /**
+         * Measured upload and scanning throughput of the server in bytes per millisecond
+         */
+        double uploadRate;
+        double scanRate;
+
+        /**
+         * Limit of scans in progress
+         */
+        ConcurrencyLimiter limiter;
+
+        /**
+         * Count of scans in progress in each lane
+         */
+        size_t laneLoad[LaneCount];
+
+        /**
+         * Largest file ClamAV Server accepts by INSTREAM, 0 if unknown
+         */
+        unsigned long long streamLimit;
+
+        /**
+         * Count of leased sessions and sessions being opened, mutex must be held
+         * 
+         * \return (size_t) count
+         */
+        size_t countLoad() const;
+
+        /**
+         * Lane of a file
+         * 
+         * \param size (unsigned long long) file size
+         * \return (Lane) lane
+         */
+        Lane getLane(unsigned long long size) const;
+
+        /**
+         * Share of concurrency limit reserved for a lane, mutex must be held
+         * 
+         * \param lane (Lane) lane
+         * \return (size_t) count of scans
+         */
+        size_t getReserve(Lane lane) const;
+
+        /**
+         * Whether another scan of a lane may start: below limit and not taking capacity reserved 
+         * by other lanes, unless within its own reserve. Mutex must be held.
+         * 
+         * \param lane (Lane) lane
+         * \return (bool) result
+         */
+        bool isAdmitted(Lane lane) const;
+
+        /**
+         * Lane with the fewest sessions, it gets the next pre-opened session. Mutex must be held.
+         * 
+         * \return (Lane) lane
+         */
+        Lane getSparseLane() const;
+
+        /**
+         * Open new session and add it to the pool, must be called without mutex held
+         * 
+         * \param leased (bool) whether the new session is leased to the caller
+         * \param lane (Lane) lane of the new session
+         * \return (SessionPtr) session or empty pointer on failure
+         */
+        SessionPtr grow(bool leased, Lane lane);
+
+        /**
+         * Lease session regardless of circuit breaker
+         * 
+         * \param wait (bool) whether to wait for a free session when the pool is exhausted
+         * \param size (const unsigned long long *) size of scanned file, NULL when the session is not used for a scan;
+         * scans are limited by concurrency limit of their lane and use sessions of their lane or idle sessions
+         * \param overloaded (bool *) set to true when a scan is refused because of the limit
+         * \param shed (bool *) set to true when a waiting scan is refused without queueing because it is larger 
+         * than shedSize
+         * \return (SessionPtr) session or empty pointer when ClamAV Server is not reachable
+         */
+        SessionPtr acquire(bool wait = true, const unsigned long long *size = NULL, bool *overloaded = NULL, 
+                bool *shed = NULL);
+
     public:
-        MutexPtr mutex;
-        
         /**
          * Constructor
+         * 
+         * \param _server server address, see SyncStream::connect
+         * \param _config pool parameters
          */
-        SyncStream(int _timeout)
-            :stream(new boost::asio::ip::tcp::iostream()),timeout(_timeout),mutex(new MutexType) {            
-        }
-        
+        Pool(const std::string &_server, const PoolConfig &_config);
+
         /**
-         * Connect to server
+         * Open sessions up to minimal count
          * 
-         * \param server server address with port separater by colon
-         * \return true on success, false otherwise
+         * \return (size_t) count of open sessions
          */
-        bool connect(std::string &server);
-        
+        size_t fill();
+
         /**
-         * Read data from server
+         * Lease session, waits for a free session when the pool is exhausted. Scans also wait in queue 
+         * while the concurrency limit is reached, or they are refused depending on overload policy.
          * 
-         * \param id (unsigned int *) id of operation
-         * \param output (string &) output string stream
-         * \return (bool) result
+         * \param size (const unsigned long long *) size of scanned file, NULL when the session is not used for a scan
+         * \param overloaded (bool *) set to true when the scan is refused because the server is overloaded
+         * \param shed (bool *) set to true when the scan is refused by overload policy because of its size
+         * \return (SessionPtr) session or empty pointer when ClamAV Server is not reachable or circuit breaker is open
          */
-        bool readString(std::string &output, unsigned int *id = NULL);
+        SessionPtr lease(const unsigned long long *size = NULL, bool *overloaded = NULL, bool *shed = NULL);
 
         /**
-         * Send string to ClamAV Server
+         * Lease session for a scan only if the server is healthy and a session is free or can be opened
          * 
-         * \param input (const string &) data
-         * \return (bool) result
+         * \param size (unsigned long long) size of scanned file
+         * \return (SessionPtr) session or empty pointer
          */
-        bool sendString(const std::string & input);
+        SessionPtr tryLease(unsigned long long size);
 
         /**
-         * Send file as STREAM to ClamAV Server 
+         * Time budget of uploading a file, computed from measured throughput
          * 
-         * \param file (const string &) file
-         * \return (bool) result
+         * \param size (unsigned long long) file size
+         * \return (long long) milliseconds
          */
-        bool sendFile(const std::string & file);
-        
+        long long getUploadTime(unsigned long long size);
+
         /**
-         * StartSession (atomic operation)
+         * Time budget of waiting for verdict of a file, computed from measured throughput
          * 
-         * \return (bool) result
+         * \param size (unsigned long long) file size
+         * \return (long long) milliseconds
          */
-        bool startSession();
+        long long getVerdictTime(unsigned long long size);
 
         /**
-         * Get version (atomic operation)
+         * Update measured throughput and concurrency limit by a finished scan
          * 
-         * \param version (std::string &) result
-         * \return (bool)
+         * \param size (unsigned long long) file size
+         * \param uploadTime (long long) milliseconds of upload, negative when the file was not uploaded
+         * \param verdictTime (long long) milliseconds from end of upload to reply
+         * \return (void)
          */
-        bool getVersion(std::string &version);
+        void measure(unsigned long long size, long long uploadTime, long long verdictTime);
 
         /**
-         * Send PING and receive PONG (clam protocol)
+         * Lower concurrency limit, the server is congested (scan timed out, clamd queues requests)
          * 
-         * \param error (std::string &) error message when return value is false
+         * \return (void)
+         */
+        void congested();
+
+        /**
+         * Whether a file is larger than ClamAV Server accepts by INSTREAM (StreamMaxLength of clamd)
+         * 
+         * \param size (unsigned long long) file size
          * \return (bool) result
          */
-        bool sendPingPong(std::string &error);
+        bool exceedsStreamLimit(unsigned long long size);
+
+        /**
+         * Learn StreamMaxLength of ClamAV Server from a refused upload
+         * 
+         * \param size (unsigned long long) size of refused file
+         * \return (void)
+         */
+        void limitStream(unsigned long long size);
+
+        /**
+         * Ask the server for STATS and lower concurrency limit when its threads are exhausted
+         * 
+         * \return (void)
+         */
+        void checkStats();
+
+        /**
+         * Record result of a scan for circuit breaker
+         * 
+         * \param succeeded (bool) whether ClamAV Server has answered
+         * \return (void)
+         */
+        void report(bool succeeded);
+
+        /**
+         * Ping the server when its open circuit breaker waits for a probe, so that it recovers without scans
+         * 
+         * \return (void)
+         */
+        void probe();
+
+        /**
+         * Return leased session
+         * 
+         * \param session (SessionPtr &) session returned by lease()
+         * \param size (const unsigned long long *) size of scanned file as passed to lease()
+         * \return (void)
+         */
+        void release(SessionPtr &session, const unsigned long long *size = NULL);
+
+        /**
+         * Drop broken sessions, close sessions idle for too long and refill to minimum
+         * 
+         * \return (void)
+         */
+        void trim();
+
+        /**
+         * Collect sessions idle long enough to need keep-alive and compute when the pool needs attention next
+         * 
+         * \param now (long long) time from monotonic clock
+         * \param pingAfter (long long) milliseconds of idleness after which a session is pinged
+         * \param due (Sessions &) sessions to be pinged are appended
+         * \return (long long) time from monotonic clock of the next ping, idle close or probe, negative when none
+         */
+        long long schedule(long long now, long long pingAfter, Sessions &due);
+
+        /**
+         * Close all sessions
+         * 
+         * \return (void)
+         */
+        void close();
+
+        /**
+         * Server address of the pool
+         * 
+         * \return (const std::string &) address
+         */
+        const std::string &getServer() const;
+
+        /**
+         * Count of leased sessions, i.e. outstanding scans
+         * 
+         * \return (size_t) count
+         */
+        size_t getLoad();
 
         /**
-         * EndSession (atomic operation)
+         * Whether the server may be used, i.e. its circuit breaker admits scans
          * 
          * \return (bool) result
          */
-        bool endSession();
+        bool isAvailable();
     };
 
     /**
-     * Pointer to SyncStream
+     * Pointer to Pool
      */
-    typedef boost::shared_ptr<SyncStream> SyncStreamPtr;
+    typedef boost::shared_ptr<Pool> PoolPtr;
+
+    /**
+     * Pools of all ClamAV Servers
+     */
+    typedef std::vector<PoolPtr> Backends;
+
+    /**
+     * Context of one avserver worker thread
+     */
+    struct ThreadContext {
+        /**
+         * Request reused by every scan of the thread
+         */
+        Request request;
+
+        /**
+         * Request of the same scan sent to another server when the verdict is late
+         */
+        Request hedge;
+
+        /**
+         * Answer of the last scan, keeps its capacity between scans
+         */
+        std::string answer;
+
+        /**
+         * Leading bytes of the scanned file for its affinity key
+         */
+        std::vector<char> sample;
+
+        /**
+         * Constructor
+         */
+        ThreadContext() {
+            hedge.partner = &request;
+        }
+
+        /**
+         * Free buffers of the context before it is parked for reuse, they are allocated again by the next scan
+         * 
+         * \return (void)
+         */
+        void release() {
+            std::string().swap(answer);
+            std::string().swap(request.answer);
+            std::string().swap(hedge.answer);
+            std::vector<char>().swap(sample);
+        }
+    };
 
     /**
-     * Vector of synchronized streams
+     * Contexts of closed threads kept for reuse, avserver creates and closes threads often
      */
-    typedef std::vector<SyncStreamPtr> ThreadStreams;
+    std::vector<ThreadContext *> freeContexts;
+    MutexType contextsMutex;
 
     /**
      * Currect status of this plugin
@@ -223,9 +1324,64 @@ private:
     volatile bool closing;
 
     /**
-     * Actual server address
+     * Path of clamd local socket, empty when TCP is used
+     */
+    std::string localSocket;
+
+    /**
+     * Configured ClamAV Server addresses, each is host name or IP address with optional port
+     */
+    std::vector<std::string> addresses;
+
+    /**
+     * Default port of ClamAV Servers
+     */
+    std::string port;
+
+    /**
+     * Seconds between re-resolving of addresses, 0 disables it
+     */
+    int resolveInterval;
+
+    /**
+     * Send identical files to the same ClamAV Server to hit its result cache
+     */
+    bool affinity;
+
+    /**
+     * Reactor dispatching replies of all sessions, it outlives the pools
+     */
+    Reactor reactor;
+
+    /**
+     * Pool parameters of each ClamAV Server
+     */
+    PoolConfig poolConfig;
+
+    /**
+     * Count of scan replays after connection failure
+     */
+    int scanRetries;
+
+    /**
+     * Verdict times of recent scans, hedging starts at their percentile
      */
-    std::string server;
+    LatencyTracker latency;
+
+    /**
+     * Percentile of verdict times after which a scan is hedged
+     */
+    int hedgePercentile;
+
+    /**
+     * Limit of hedged scans
+     */
+    HedgeBudget hedgeBudget;
+
+    /**
+     * Counter for random choices of load balancing
+     */
+    volatile int balancerCounter;
         
     /**
      * Timeout in seconds for scanning connection
@@ -233,14 +1389,34 @@ private:
     int timeout;
 
     /**
-     * Mutex to secure connVector variable
+     * SCAN or CONTSCAN when ClamAV Server reads files by path, empty for streaming
+     */
+    std::string scanCommand;
+
+    /**
+     * Prefix of avserver paths rewritten for path based scanning
+     */
+    std::string pathPrefix;
+
+    /**
+     * Replacement of pathPrefix as seen by ClamAV Server
+     */
+    std::string serverPathPrefix;
+
+    /**
+     * Mutex to secure backends and retired variables
+     */
+    MutexType backendsMutex;
+
+    /**
+     * Connections to ClamAV Servers shared by scanning threads
      */
-    MutexType connMutex;
+    Backends backends;
 
     /**
-     * Vector of connections for ping-ponging
+     * Pools of servers which disappeared from DNS, closed once their scans finish
      */
-    ThreadStreams connVector;
+    Backends retired;
 
     /**
      * Handle for keep-a-live thread
@@ -248,20 +1424,104 @@ private:
     boost::thread *pingThreadHandle;
 
     /**
-     * Add connection to vector for keep-alive
+     * Seconds after which ClamAV Server closes idle connection (IdleTimeout of clamd)
+     */
+    int idleTimeout;
+
+    /**
+     * Seconds between STATS checks of ClamAV Servers, 0 disables them
+     */
+    int statsInterval;
+
+    /**
+     * Last VERSION reply of each ClamAV Server, reported to verdict cache
+     */
+    std::map<std::string, std::string> engineVersions;
+
+    /**
+     * Wakes keep-a-live thread up when closing
+     */
+    MutexType scheduleMutex;
+    boost::condition_variable scheduleChanged;
+
+    /**
+     * Translate avserver path to path visible by ClamAV Server
      * 
-     * \param conn (SyncStreamPtr) TCP stream
-     * \return (void)
+     * \param filename (const char *) local path
+     * \return (std::string) path for ClamAV Server
+     */
+    std::string mapPath(const char *filename) const;
+
+    /**
+     * One attempt to scan a file: lease session of chosen server, send the file and wait for reply
+     * 
+     * \param context (ThreadContext &) requests of calling thread
+     * \param filename (const char *) file to scan
+     * \param fd (int) descriptor of the file
+     * \param size (unsigned long long) file size used for deadlines
+     * \param key (const unsigned long long *) affinity key or NULL
+     * \param answer (std::string &) reply of ClamAV Server or error message
+     * \return (ScanOutcome) ScanAnswered if answer holds reply
+     */
+    ScanOutcome scanFile(ThreadContext &context, const char *filename, int fd, unsigned long long size, 
+            const unsigned long long *key, std::string &answer);
+
+    /**
+     * Wait for verdict of streamed file. When it is later than usual for files of that size and hedge budget allows,
+     * the file is sent to another server too, the first verdict wins and the other request is withdrawn.
+     * 
+     * \param context (ThreadContext &) requests of calling thread, request is submitted already
+     * \param filename (const char *) file being scanned
+     * \param fd (int) descriptor of the file
+     * \param size (unsigned long long) file size
+     * \param key (const unsigned long long *) affinity key or NULL
+     * \param pool (const PoolPtr &) server of submitted request
+     * \param session (const SessionPtr &) session of submitted request
+     * \param start (long long) time from monotonic clock when upload finished
+     * \param deadline (long long) time from monotonic clock by which the verdict must arrive
+     * \param expired (bool &) set to true when deadline has passed
+     * \param answer (std::string &) reply or error message
+     * \param hedgedBy (PoolPtr &) set to the other server when it has answered first
+     * \return (bool) true if reply was received
+     */
+    bool awaitVerdict(ThreadContext &context, const char *filename, int fd, unsigned long long size, 
+            const unsigned long long *key, const PoolPtr &pool, const SessionPtr &session, long long start, long long deadline, 
+            bool &expired, std::string &answer, PoolPtr &hedgedBy);
+
+    /**
+     * Resolve configured addresses to list of servers, all A/AAAA records of a host name are used
+     * 
+     * \param servers (std::vector<std::string> &) resolved addresses with port
+     * \param error (std::string &) error message when return value is false
+     * \return (bool) result
      */
-    void startConnectionRefresh(SyncStreamPtr &conn);
+    bool resolveServers(std::vector<std::string> &servers, std::string &error);
 
     /**
-     * Remove connection from vector for keep-alive
+     * Replace backends by given servers, pools of remaining servers are kept
      * 
-     * \param conn (SyncStreamPtr) TCP stream
+     * \param servers (const std::vector<std::string> &) server addresses
      * \return (void)
      */
-    void dropConnectionRefresh(SyncStreamPtr &conn);
+    void updateBackends(const std::vector<std::string> &servers);
+
+    /**
+     * Choose backend for one scan, the less loaded of two random available backends 
+     * or the backend with highest rendezvous score for affinity key
+     * 
+     * \param affinityKey (const unsigned long long *) content hash or NULL
+     * \param exclude (const PoolPtr *) backends already tried by this scan
+     * \param excluded (size_t) count of backends in exclude
+     * \return (PoolPtr) backend or empty pointer when no other backend is available
+     */
+    PoolPtr pickBackend(const unsigned long long *affinityKey, const PoolPtr *exclude, size_t excluded);
+
+    /**
+     * Copy of current backends
+     * 
+     * \return (Backends) backends
+     */
+    Backends getBackends();
 
     /**
      * Wrapper for keep-a-live thread
@@ -272,11 +1532,28 @@ private:
     static void keepAliveThreadWrapper(void *params);
 
     /**
-     * Thread for keep-a-live
+     * Thread for keep-a-live, it sleeps until some session or pool needs attention
      * 
      * \return (void)
      */
     void keepAliveThread();
+
+    /**
+     * Ask available servers for VERSION and report versions of all servers to verdict cache, 
+     * so that verdicts are dropped after signature update
+     * 
+     * \return (void)
+     */
+    void checkVersions();
+
+    /**
+     * Ping sessions concurrently, all PINGs are sent before any PONG is awaited
+     * 
+     * \param pools (const Backends &) pool of each session
+     * \param sessions (const Sessions &) sessions to ping
+     * \return (void)
+     */
+    void pingSessions(const Backends &pools, const Sessions &sessions);
 };
 
 #endif // CLAM_PLUGIN_HPP
@@ -0,0 +1,472 @@
+/**
+ * Copyright (C) 1997-2012 Kerio Technologies s.r.o.
+ *
+ * avbench -- microbenchmark of the scan path of avir_clam, it proves that a scan does not allocate in steady state.
+ *
+ * Usage: avbench [plugin [warm-up-scans [scans]]]
+ *
+ * The plugin (./avir_clam.so by default) is loaded like avserver loads it and connected to a ClamAV Server
+ * emulated in this process. One file is rewritten before every scan, so that every scan misses the verdict
+ * cache and goes to the server through the whole path: hashing, sharing, upload, reply, cache and journal.
+ * Warm-up scans fill the verdict cache and the buffers, then heap allocations of the scanning thread are counted
+ * during the measured scans. Background threads of the plugin (maintenance, log) are not counted, they wake up
+ * independently of scans and would make the result depend on timing. Exits with 1 if any measured scan allocated.
+ *
+ * Allocations are counted by interposing malloc, calloc and realloc, which requires glibc.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "avApi.h"
+
+/**
+ * Default counts of warm-up and measured scans, warm-up fills the default 1 MB verdict cache
+ */
+#define DEFAULT_WARM_UP 30000
+#define DEFAULT_SCANS 10000
+
+/**
+ * Size of the scanned file
+ */
+#define BENCH_FILE_SIZE 4096
+
+/**
+ * Receive buffer of one emulated server connection
+ */
+#define BENCH_BUFFER 65536
+
+/**
+ * Version reported by the emulated server
+ */
+#define BENCH_VERSION "ClamAV 0.103.8/26700/Mon Oct 16 12:00:00 2026"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/**
+ * Heap allocations of the scanning thread
+ */
+static volatile unsigned long allocations = 0;
+
+/**
+ * Non-zero in the thread running the measured scans, allocations of other threads are not counted
+ */
+static __thread int scanningThread = 0;
+
+void *malloc(size_t size)
+{
+    if (scanningThread) {
+        __sync_fetch_and_add(&allocations, 1);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (scanningThread) {
+        __sync_fetch_and_add(&allocations, 1);
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (scanningThread) {
+        __sync_fetch_and_add(&allocations, 1);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+/*
+ * Emulated ClamAV Server
+ */
+
+/**
+ * Connection of the plugin to the emulated server
+ */
+typedef struct _benchConnection {
+    int fd;
+    size_t start;
+    size_t end;
+    char data[BENCH_BUFFER];
+} benchConnection;
+
+/**
+ * Make sure that the buffer holds the given count of bytes
+ *
+ * \return 0 when the connection is closed
+ */
+static int fill(benchConnection *connection, size_t count)
+{
+    ssize_t received;
+
+    if (connection->end - connection->start >= count) {
+        return 1;
+    }
+    memmove(connection->data, connection->data + connection->start, connection->end - connection->start);
+    connection->end -= connection->start;
+    connection->start = 0;
+    while (connection->end < count) {
+        received = recv(connection->fd, connection->data + connection->end, sizeof(connection->data) - connection->end, 0);
+        if ((received < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0) {
+            return 0;
+        }
+        connection->end += (size_t) received;
+    }
+    return 1;
+}
+
+/**
+ * Skip the given count of received bytes
+ *
+ * \return 0 when the connection is closed
+ */
+static int skip(benchConnection *connection, unsigned long count)
+{
+    size_t part;
+
+    while (count > 0) {
+        part = (count < sizeof(connection->data)) ? (size_t) count : sizeof(connection->data);
+        if (!fill(connection, part)) {
+            return 0;
+        }
+        connection->start += part;
+        count -= part;
+    }
+    return 1;
+}
+
+/**
+ * Read one command, "zCOMMAND\0" or "nCOMMAND\n"
+ *
+ * \return 0 when the connection is closed or the command is too long
+ */
+static int readCommand(benchConnection *connection, char *command, size_t size, char *terminator)
+{
+    size_t length = 0;
+
+    if (!fill(connection, 1)) {
+        return 0;
+    }
+    *terminator = (connection->data[connection->start++] == 'n') ? '\n' : 0;
+    for (;;) {
+        if (!fill(connection, 1)) {
+            return 0;
+        }
+        if (connection->data[connection->start] == *terminator) {
+            connection->start++;
+            command[length] = 0;
+            return 1;
+        }
+        if (length + 1 >= size) {
+            return 0;
+        }
+        command[length++] = connection->data[connection->start++];
+    }
+}
+
+/**
+ * Send one reply, prefixed by the request id in a session
+ */
+static int reply(benchConnection *connection, unsigned int id, const char *answer, char terminator)
+{
+    char line[MAX_STRING];
+    size_t sent = 0;
+    ssize_t count;
+    int length;
+
+    length = id ? snprintf(line, sizeof(line) - 1, "%u: %s", id, answer) : snprintf(line, sizeof(line) - 1, "%s", answer);
+    line[length++] = terminator;
+    while (sent < (size_t) length) {
+        count = send(connection->fd, line + sent, (size_t) length - sent, MSG_NOSIGNAL);
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (count <= 0) {
+            return 0;
+        }
+        sent += (size_t) count;
+    }
+    return 1;
+}
+
+/**
+ * Serve one connection: IDSESSION, END, PING, VERSION, STATS and INSTREAM, every stream is clean
+ */
+static void *serveConnection(void *param)
+{
+    benchConnection *connection = (benchConnection *) malloc(sizeof(benchConnection));
+    char command[MAX_STRING];
+    char terminator;
+    unsigned int id = 0;
+    unsigned long length = 0;
+    int session = 0;
+    int served;
+
+    connection->fd = (int) (long) param;
+    connection->start = connection->end = 0;
+    while (readCommand(connection, command, sizeof(command), &terminator)) {
+        id += session;
+        if (0 == strcmp(command, "IDSESSION")) {
+            session = 1;
+            continue;
+        }
+        if (0 == strcmp(command, "END")) {
+            break;
+        }
+        if (0 == strcmp(command, "PING")) {
+            served = reply(connection, id, "PONG", terminator);
+        }
+        else if (0 == strcmp(command, "VERSION")) {
+            served = reply(connection, id, BENCH_VERSION, terminator);
+        }
+        else if (0 == strcmp(command, "STATS")) {
+            served = reply(connection, id, "POOLS: 1\n\nSTATE: VALID PRIMARY\n"
+                    "THREADS: live 1  idle 15 max 16 idle-timeout 30\nQUEUE: 0 items\nEND", terminator);
+        }
+        else if (0 == strcmp(command, "INSTREAM")) {
+            do {
+                served = fill(connection, 4);
+                if (served) {
+                    length = ntohl(*(unsigned int *) (connection->data + connection->start));
+                    connection->start += 4;
+                    served = skip(connection, length);
+                }
+            } while (served && (length > 0));
+            served = served && reply(connection, id, "stream: OK", terminator);
+        }
+        else {
+            served = reply(connection, id, "UNKNOWN COMMAND", terminator);
+        }
+        if (!served || !session) {
+            break;
+        }
+    }
+    close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+/**
+ * Accept connections of the plugin, each one is served by its own thread
+ */
+static void *serve(void *param)
+{
+    int listener = (int) (long) param;
+    pthread_t thread;
+    long fd;
+
+    for (;;) {
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        if (0 != pthread_create(&thread, NULL, serveConnection, (void *) fd)) {
+            close((int) fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Start the emulated server on a free port of the loopback
+ *
+ * \return port, 0 on error
+ */
+static unsigned short startServer(void)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    pthread_t thread;
+    int listener;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return 0;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((0 != bind(listener, (struct sockaddr *) &address, sizeof(address))) || (0 != listen(listener, 64)) ||
+            (0 != getsockname(listener, (struct sockaddr *) &address, &length)) ||
+            (0 != pthread_create(&thread, NULL, serve, (void *) (long) listener))) {
+        close(listener);
+        return 0;
+    }
+    pthread_detach(thread);
+    return ntohs(address.sin_port);
+}
+
+/*
+ * Benchmark
+ */
+
+static void logMessage(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+static void setOption(avir_plugin_config *option, const char *name, const char *value)
+{
+    memset(option, 0, sizeof(*option));
+    strncpy(option->name, name, sizeof(option->name) - 1);
+    strncpy(option->value, value, sizeof(option->value) - 1);
+}
+
+/**
+ * Rewrite the head of the file and scan it
+ *
+ * \return check result code
+ */
+static int scan(avir_plugin_extended_thread_iface *plugin, void *context, int fd, const char *filename,
+        unsigned long long counter)
+{
+    char info[MAX_STRING];
+
+    if (sizeof(counter) != pwrite(fd, &counter, sizeof(counter), 0)) {
+        return AVCHK_ERROR;
+    }
+    info[0] = 0;
+    return plugin->plugin_thread_test_file(context, filename, "bench.bin", NULL, 0, info, sizeof(info));
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "./avir_clam.so";
+    unsigned long warmUp = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_WARM_UP;
+    unsigned long scans = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_SCANS;
+    GET_PLUGIN_EXTENDED_IFACE getInterface;
+    avir_plugin_extended_thread_iface *plugin;
+    avir_plugin_config config[16];
+    char directory[] = "/tmp/avbench.XXXXXX";
+    char filename[MAX_STRING];
+    char cacheFile[MAX_STRING];
+    char journalFile[MAX_STRING];
+    char port[16];
+    char content[BENCH_FILE_SIZE];
+    unsigned long long counter = 0;
+    unsigned long before;
+    unsigned long counted;
+    unsigned long failed = 0;
+    unsigned int version;
+    unsigned short serverPort;
+    struct timespec start;
+    void *context = NULL;
+    void *library;
+    double seconds;
+    int fd;
+    int i = 0;
+
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [plugin [warm-up-scans [scans]]]\n", argv[0]);
+        return 2;
+    }
+    serverPort = startServer();
+    if (serverPort == 0) {
+        fprintf(stderr, "Cannot start ClamAV Server emulation: %s\n", strerror(errno));
+        return 2;
+    }
+    library = dlopen(path, RTLD_NOW);
+    if (library == NULL) {
+        fprintf(stderr, "Cannot load plugin: %s\n", dlerror());
+        return 2;
+    }
+    getInterface = (GET_PLUGIN_EXTENDED_IFACE) dlsym(library, "get_plugin_extended_iface");
+    if (getInterface == NULL) {
+        fprintf(stderr, "%s is not an antivirus plugin\n", path);
+        return 2;
+    }
+    plugin = getInterface(&version);
+
+    /* private directory for the scanned file, the verdict cache file and the journal */
+    if (NULL == mkdtemp(directory)) {
+        fprintf(stderr, "Cannot create temporary directory: %s\n", strerror(errno));
+        return 2;
+    }
+    snprintf(filename, sizeof(filename), "%s/bench.bin", directory);
+    snprintf(cacheFile, sizeof(cacheFile), "%s/verdicts.cache", directory);
+    snprintf(journalFile, sizeof(journalFile), "%s/scans.journal", directory);
+    snprintf(port, sizeof(port), "%u", (unsigned int) serverPort);
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    memset(content, 'x', sizeof(content));
+    if ((fd < 0) || (sizeof(content) != write(fd, content, sizeof(content)))) {
+        fprintf(stderr, "Cannot write %s: %s\n", filename, strerror(errno));
+        return 2;
+    }
+
+    setOption(&config[i++], "Address", "127.0.0.1");
+    setOption(&config[i++], "Port", port);
+    setOption(&config[i++], "MinConnections", "1");
+    setOption(&config[i++], "StatsInterval", "0");
+    setOption(&config[i++], "HedgeBudget", "0");
+    setOption(&config[i++], "VerdictCacheSize", "1");
+    setOption(&config[i++], "VerdictCacheFile", cacheFile);
+    setOption(&config[i++], "VerdictCacheFileSize", "1");
+    setOption(&config[i++], "ScanJournalFile", journalFile);
+    setOption(&config[i++], "ScanJournalFileSize", "1");
+    setOption(&config[i++], "", "");
+    if (!plugin->set_plugin_config(config) || !plugin->plugin_init(logMessage) || !plugin->plugin_thread_init(&context)) {
+        fprintf(stderr, "Cannot initialize plugin\n");
+        return 2;
+    }
+
+    for (; counter < warmUp; counter++) {
+        failed += (AVCHK_OK != scan(plugin, context, fd, filename, counter));
+    }
+
+    before = allocations;
+    scanningThread = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; counter < warmUp + scans; counter++) {
+        failed += (AVCHK_OK != scan(plugin, context, fd, filename, counter));
+    }
+    seconds = elapsed(&start);
+    scanningThread = 0;
+    counted = allocations - before;
+
+    plugin->plugin_thread_close(&context);
+    plugin->plugin_close();
+    close(fd);
+    unlink(filename);
+    unlink(cacheFile);
+    unlink(journalFile);
+    rmdir(directory);
+
+    printf("%lu scans in %.3f s, %.1f us per scan, %lu failed, %lu allocations (%.3f per scan)\n", scans, seconds,
+            scans ? seconds * 1e6 / scans : 0.0, failed, counted, scans ? (double) counted / scans : 0.0);
+    return (failed || counted) ? 1 : 0;
+}
@@ -28,7 +28,41 @@ ClamPlugin plugin;
 avir_plugin_config plugin_config[] = {
     {"Address", "127.0.0.1"},
     {"Port", "3310"},
+    {"LocalSocket", ""},
+    {"ResolveInterval", "300"},
+    {"Affinity", "0"},
+    {"ScanRetries", "2"},
     {"StartupTimeout", "90"},
+    {"MinConnections", "2"},
+    {"MaxConnections", "16"},
+    {"PipelineDepth", "4"},
+    {"PoolIdleTime", "120"},
+    {"BreakerThreshold", "5"},
+    {"BreakerOpenTime", "10"},
+    {"ConnectTimeout", "5"},
+    {"ScanTimeout", "120"},
+    {"QueueTimeout", "30"},
+    {"OverloadPolicy", "Queue"},
+    {"ShedSize", "1024"},
+    {"MediumFileSize", "1024"},
+    {"LargeFileSize", "16384"},
+    {"StreamChunkSize", "1024"},
+    {"StreamMaxLength", "0"},
+    {"StatsInterval", "10"},
+    {"HedgeBudget", "5"},
+    {"HedgePercentile", "95"},
+    {"IdleTimeout", "30"},
+    {"LogLevel", "Warning"},
+    {"LogLevelFile", ""},
+    {"LogQueueSize", "1024"},
+    {"VerdictCacheSize", "32"},
+    {"VerdictCacheFile", "/var/lib/avir_clam/verdicts.cache"},
+    {"VerdictCacheFileSize", "64"},
+    {"ScanJournalFile", "/var/lib/avir_clam/scans.journal"},
+    {"ScanJournalFileSize", "16"},
+    {"ScanMode", "Stream"},
+    {"PathPrefix", ""},
+    {"ServerPathPrefix", ""},
     {"", ""}
 };
 
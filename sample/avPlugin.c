@@ -7,7 +7,8 @@
  *
  * To create your own plugin, provide bodies for the functions below.
  *
- * Compile together with ../api/avCommon.c.
+ * Compile together with ../api/avCommon.c, ../api/avCache.c, ../api/avLog.c and ../api/avJournal.c,
+ * link with -lpthread.
  */
 
 #include <string.h>